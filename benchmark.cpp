@@ -0,0 +1,334 @@
+#include "expression.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+size_t currentBytes = 0;
+size_t peakBytes = 0;
+
+constexpr size_t allocationHeader = alignof(std::max_align_t);
+
+void* trackedAllocate(size_t size) {
+    void* block = std::malloc(size + allocationHeader);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(block) = size;
+    currentBytes += size;
+    if (currentBytes > peakBytes) {
+        peakBytes = currentBytes;
+    }
+    return static_cast<char*>(block) + allocationHeader;
+}
+
+void trackedRelease(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    void* block = static_cast<char*>(ptr) - allocationHeader;
+    currentBytes -= *static_cast<size_t*>(block);
+    std::free(block);
+}
+
+}
+
+void* operator new(size_t size) { return trackedAllocate(size); }
+void* operator new[](size_t size) { return trackedAllocate(size); }
+void operator delete(void* ptr) noexcept { trackedRelease(ptr); }
+void operator delete[](void* ptr) noexcept { trackedRelease(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedRelease(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedRelease(ptr); }
+
+namespace {
+
+struct CorpusConfig {
+    size_t size;
+    size_t depth;
+    size_t variables;
+    size_t count;
+};
+
+std::string variableName(size_t index) {
+    std::string name = "v";
+    do {
+        name += static_cast<char>('a' + index % 26);
+        index /= 26;
+    } while (index > 0);
+    return name;
+}
+
+class CorpusGenerator {
+public:
+    CorpusGenerator(const CorpusConfig& config, unsigned seed) : config(config), rng(seed) {}
+
+    std::string next() {
+        return generate(config.size, config.depth);
+    }
+
+private:
+    CorpusConfig config;
+    std::mt19937 rng;
+
+    size_t pick(size_t n) {
+        return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+    }
+
+    std::string leaf() {
+        if (pick(3) == 0) {
+            return std::to_string(1 + pick(9)) + "." + std::to_string(pick(10));
+        }
+        return variableName(pick(config.variables));
+    }
+
+    std::string generate(size_t nodes, size_t depth) {
+        if (nodes <= 1 || depth == 0) {
+            return leaf();
+        }
+        if (pick(5) == 0) {
+            static const char* functions[] = {"sin", "cos", "exp", "ln"};
+            return std::string(functions[pick(4)]) + "(" + generate(nodes - 1, depth - 1) + ")";
+        }
+        if (nodes <= 3 && pick(4) == 0) {
+            return "(" + generate(nodes - 2, depth - 1) + ")^" + std::to_string(2 + pick(2));
+        }
+        static const char ops[] = {'+', '-', '*', '/'};
+        size_t leftNodes = 1 + pick(nodes - 1 > 1 ? nodes - 2 : 1);
+        size_t rightNodes = nodes - 1 - leftNodes > 0 ? nodes - 1 - leftNodes : 1;
+        return "(" + generate(leftNodes, depth - 1) + " " + ops[pick(4)] + " " + generate(rightNodes, depth - 1) + ")";
+    }
+};
+
+template<typename T>
+T variableValue(size_t index) {
+    double real = 0.5 + 0.25 * static_cast<double>(index % 7);
+    if constexpr (IsComplex<T>::value) {
+        return T(real, 0.1 * static_cast<double>(index % 3));
+    } else {
+        return static_cast<T>(real);
+    }
+}
+
+struct Measurement {
+    double seconds;
+    size_t operations;
+    size_t peak;
+};
+
+template<typename F>
+Measurement measure(size_t operations, size_t repeat, F&& body) {
+    size_t baseline = currentBytes;
+    peakBytes = currentBytes;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < repeat; ++r) {
+        body();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return {std::chrono::duration<double>(stop - start).count(), operations * repeat, peakBytes - baseline};
+}
+
+void printHeader() {
+    std::cout << "type,phase,size,depth,variables,count,repeat,seconds,ops_per_sec,ns_per_op,peak_bytes" << std::endl;
+}
+
+void printRow(const std::string& type, const std::string& phase, const CorpusConfig& config, size_t repeat, const Measurement& m) {
+    double opsPerSec = m.seconds > 0 ? static_cast<double>(m.operations) / m.seconds : 0.0;
+    double nsPerOp = m.operations > 0 ? m.seconds * 1e9 / static_cast<double>(m.operations) : 0.0;
+    std::cout << type << "," << phase << "," << config.size << "," << config.depth << "," << config.variables << ","
+              << config.count << "," << repeat << "," << m.seconds << "," << opsPerSec << "," << nsPerOp << ","
+              << m.peak << std::endl;
+}
+
+template<typename T>
+void runCorpus(const std::string& type, const CorpusConfig& config, size_t repeat, unsigned seed) {
+    CorpusGenerator generator(config, seed);
+    std::vector<std::string> sources;
+    for (size_t i = 0; i < config.count; ++i) {
+        sources.push_back(generator.next());
+    }
+
+    std::map<std::string, T> variables;
+    for (size_t v = 0; v < config.variables; ++v) {
+        variables[variableName(v)] = variableValue<T>(v);
+    }
+    const std::string target = variableName(0);
+    volatile size_t sink = 0;
+
+    std::vector<Expression<T>> parsed;
+    parsed.reserve(config.count);
+    auto parse = measure(config.count, repeat, [&] {
+        parsed.clear();
+        for (const auto& source : sources) {
+            parsed.push_back(Expression<T>::fromString(source));
+        }
+    });
+    printRow(type, "parse", config, repeat, parse);
+
+    auto evaluate = measure(config.count, repeat, [&] {
+        for (const auto& expr : parsed) {
+            sink = sink + (expr.evaluate(variables) ? 1 : 0);
+        }
+    });
+    printRow(type, "evaluate", config, repeat, evaluate);
+
+    ExpressionSet<T> fused(parsed);
+    auto evaluateSet = measure(config.count, repeat, [&] {
+        sink = sink + fused.evaluate(variables)->size();
+    });
+    printRow(type, "evaluateSet", config, repeat, evaluateSet);
+
+    const size_t points = 1024;
+    std::map<std::string, std::vector<T>> columns;
+    for (const auto& [name, value] : variables) {
+        auto& column = columns[name];
+        for (size_t p = 0; p < points; ++p) {
+            column.push_back(value + static_cast<T>(static_cast<double>(p) / points));
+        }
+    }
+    auto evaluateBatch = measure(config.count * points, repeat, [&] {
+        sink = sink + fused.evaluateBatch(columns)->size();
+    });
+    printRow(type, "evaluateBatch", config, repeat, evaluateBatch);
+
+    std::vector<std::string> columnNames;
+    std::vector<const T*> columnPointers;
+    for (const auto& [name, column] : columns) {
+        columnNames.push_back(name);
+        columnPointers.push_back(column.data());
+    }
+    auto binding = fused.bind(columnNames);
+    std::vector<std::vector<T>> boundResults(fused.size(), std::vector<T>(points));
+    std::vector<T*> boundOutputs;
+    for (auto& result : boundResults) {
+        boundOutputs.push_back(result.data());
+    }
+    auto evaluateBound = measure(config.count * points, repeat, [&] {
+        sink = sink + fused.evaluateBound(binding, columnPointers.data(), points, boundOutputs.data());
+    });
+    printRow(type, "evaluateBound", config, repeat, evaluateBound);
+
+    std::vector<Expression<T>> derivatives;
+    derivatives.reserve(config.count);
+    auto differentiate = measure(config.count, repeat, [&] {
+        derivatives.clear();
+        for (const auto& expr : parsed) {
+            derivatives.push_back(Expression<T>::differentiateAll({expr}, target).front());
+        }
+    });
+    printRow(type, "differentiate", config, repeat, differentiate);
+
+    for (const auto& expr : parsed) {
+        expr.differentiate(target);
+    }
+    auto differentiateCached = measure(config.count, repeat, [&] {
+        for (const auto& expr : parsed) {
+            auto derivative = expr.differentiate(target);
+            sink = sink + 1;
+        }
+    });
+    printRow(type, "differentiateCached", config, repeat, differentiateCached);
+
+    const unsigned taylorOrder = 8;
+    auto taylor = measure(config.count, repeat, [&] {
+        for (const auto& expr : parsed) {
+            sink = sink + (expr.taylorCoefficients(target, variables[target], taylorOrder, variables) ? 1 : 0);
+        }
+    });
+    printRow(type, "taylor", config, repeat, taylor);
+
+    auto simplify = measure(config.count, repeat, [&] {
+        for (const auto& expr : derivatives) {
+            sink = sink + expr.simplify().toString().size();
+        }
+    });
+    printRow(type, "simplify", config, repeat, simplify);
+
+    auto substitute = measure(config.count, repeat, [&] {
+        for (const auto& expr : parsed) {
+            sink = sink + expr.substitute(target, variables[target]).toString().size();
+        }
+    });
+    printRow(type, "substitute", config, repeat, substitute);
+
+    auto toString = measure(config.count, repeat, [&] {
+        for (const auto& expr : parsed) {
+            sink = sink + expr.toString().size();
+        }
+    });
+    printRow(type, "toString", config, repeat, toString);
+}
+
+size_t parseCount(const std::string& value) {
+    size_t count = std::stoul(value);
+    if (count == 0) {
+        throw std::invalid_argument("значение должно быть положительным");
+    }
+    return count;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<CorpusConfig> configs = {
+        {16, 6, 1, 500},
+        {64, 10, 2, 200},
+        {256, 16, 4, 10},
+    };
+    size_t repeat = 3;
+    unsigned seed = 42;
+
+    try {
+        CorpusConfig custom = {0, 0, 0, 0};
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                std::cerr << "Usage: " << argv[0] << " [--size N] [--depth D] [--vars V] [--count C] [--repeat R] [--seed S]" << std::endl;
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--size") custom.size = parseCount(value);
+            else if (arg == "--depth") custom.depth = parseCount(value);
+            else if (arg == "--vars") custom.variables = parseCount(value);
+            else if (arg == "--count") custom.count = parseCount(value);
+            else if (arg == "--repeat") repeat = parseCount(value);
+            else if (arg == "--seed") seed = static_cast<unsigned>(std::stoul(value));
+            else {
+                std::cerr << "Неизвестно: " << arg << std::endl;
+                return 1;
+            }
+        }
+        if (custom.size || custom.depth || custom.variables) {
+            custom.size = custom.size ? custom.size : 64;
+            custom.depth = custom.depth ? custom.depth : 10;
+            custom.variables = custom.variables ? custom.variables : 2;
+            custom.count = custom.count ? custom.count : 100;
+            configs = {custom};
+        } else if (custom.count) {
+            for (auto& config : configs) {
+                config.count = custom.count;
+            }
+        }
+
+        printHeader();
+        for (const auto& config : configs) {
+            runCorpus<double>("double", config, repeat, seed);
+            runCorpus<std::complex<double>>("complex", config, repeat, seed);
+            runCorpus<float>("float", config, repeat, seed);
+            runCorpus<std::complex<float>>("complex_float", config, repeat, seed);
+            runCorpus<long double>("long_double", config, repeat, seed);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Ошибка: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
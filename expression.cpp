@@ -4,18 +4,116 @@
 #include <sstream>
 #include <cctype>
 #include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <unordered_set>
+
+#ifdef EXPRESSION_PROFILING
+namespace {
+
+class PhaseTimer {
+public:
+    PhaseTimer(std::atomic<int64_t>& target) : target(target), start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        target += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::atomic<int64_t>& target;
+    std::chrono::steady_clock::time_point start;
+};
+
+}
+
+#define EXPRESSION_PROFILE_PHASE(phase) PhaseTimer phaseTimer(counters.phase)
+
+template<typename T>
+typename Expression<T>::ProfileCounters Expression<T>::counters;
+#else
+#define EXPRESSION_PROFILE_PHASE(phase)
+#endif
+
+namespace {
+
+template<typename R>
+R parseReal(const std::string& numStr) {
+    if constexpr (std::is_same_v<R, float>) {
+        return std::stof(numStr);
+    } else if constexpr (std::is_same_v<R, long double>) {
+        return std::stold(numStr);
+    } else {
+        return std::stod(numStr);
+    }
+}
+
+template<typename T>
+T parseNumber(const std::string& numStr) {
+    if constexpr (IsComplex<T>::value) {
+        return T(parseReal<typename T::value_type>(numStr), 0);
+    } else {
+        return parseReal<T>(numStr);
+    }
+}
+
+}
+
+// Маски зависимостей узлов от переменных считаются один раз на выражение и общие для всех
+// переменных: поддерево без переменной сразу получает общий нулевой узел, без обхода.
+template<typename T>
+struct Expression<T>::DerivativeCache {
+    struct Entry {
+        std::optional<Expression> derivative;
+        std::optional<Expression> simplified;
+        std::shared_ptr<const ExpressionSet<T>> compiled;
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+    bool analysed = false;
+    std::vector<std::string> names;
+    std::unordered_map<const Node*, uint64_t> dependencies;
+    NodePtr zero;
+
+    // Общий нулевой узел создаётся только при первой нулевой производной, а не для каждого кэша.
+    const NodePtr& zeroNode() {
+        if (!zero) {
+            zero = std::make_shared<ConstantNode>(0);
+        }
+        return zero;
+    }
+
+    uint64_t dependencyMask(const Node& node);
+    void seed(const NodePtr& node, uint64_t bit, NodeMemo& memo);
+    void differentiate(const NodePtr& root, const std::string& variable, Entry& entry);
+    void simplify(const NodePtr& root, const std::string& variable, Entry& entry);
+};
+
+template<typename T>
+thread_local typename Expression<T>::BudgetScope* Expression<T>::activeBudget = nullptr;
 
 template<typename T>
-Expression<T>::Expression(T value) : root(std::make_unique<ConstantNode>(value)) {}
+std::atomic<size_t> Expression<T>::cacheHits{0};
 
 template<typename T>
-Expression<T>::Expression(const std::string& variable) : root(std::make_unique<VariableNode>(variable)) {}
+std::atomic<size_t> Expression<T>::cacheMisses{0};
 
 template<typename T>
-Expression<T>::Expression(const Expression& other) : root(other.root->clone()) {}
+Expression<T>::Expression(T value) : root(std::make_shared<ConstantNode>(value)) {}
 
 template<typename T>
-Expression<T>::Expression(Expression&& other) noexcept : root(std::move(other.root)) {}
+Expression<T>::Expression(const std::string& variable) : root(std::make_shared<VariableNode>(variable)) {}
+
+template<typename T>
+Expression<T>::Expression(NodePtr root, CachePtr cache) : root(std::move(root)), cache(std::move(cache)) {}
+
+template<typename T>
+Expression<T>::Expression(const Expression& other) : root(other.root), cache(other.loadCache()) {}
+
+template<typename T>
+Expression<T>::Expression(Expression&& other) noexcept : root(std::move(other.root)), cache(other.loadCache()) {}
 
 template<typename T>
 Expression<T>::~Expression() = default;
@@ -23,7 +121,8 @@ Expression<T>::~Expression() = default;
 template<typename T>
 Expression<T>& Expression<T>::operator=(const Expression& other) {
     if (this != &other) {
-        root = other.root->clone();
+        root = other.root;
+        storeCache(other.loadCache());
     }
     return *this;
 }
@@ -32,78 +131,133 @@ template<typename T>
 Expression<T>& Expression<T>::operator=(Expression&& other) noexcept {
     if (this != &other) {
         root = std::move(other.root);
+        storeCache(other.loadCache());
     }
     return *this;
 }
 
+template<typename T>
+typename Expression<T>::CachePtr Expression<T>::loadCache() const {
+    return std::atomic_load_explicit(&cache, std::memory_order_acquire);
+}
+
+template<typename T>
+void Expression<T>::storeCache(CachePtr next) const {
+    std::atomic_store_explicit(&cache, std::move(next), std::memory_order_release);
+}
+
+// Кэш создаётся при первом обращении; из двух одновременных попыток побеждает одна.
+template<typename T>
+typename Expression<T>::DerivativeCache& Expression<T>::derivativeCache() const {
+    auto current = loadCache();
+    if (!current) {
+        auto fresh = std::make_shared<DerivativeCache>();
+        bool installed = std::atomic_compare_exchange_strong(&cache, &current, fresh);
+        if (installed) {
+            current = std::move(fresh);
+        }
+    }
+    return *current;
+}
+
 template<typename T>
 Expression<T> Expression<T>::operator+(const Expression& other) const {
-    return Expression(std::make_unique<BinaryOperationNode>('+', root->clone(), other.root->clone()));
+    return Expression(std::make_shared<BinaryOperationNode>('+', root, other.root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::operator-(const Expression& other) const {
-    return Expression(std::make_unique<BinaryOperationNode>('-', root->clone(), other.root->clone()));
+    return Expression(std::make_shared<BinaryOperationNode>('-', root, other.root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::operator*(const Expression& other) const {
-    return Expression(std::make_unique<BinaryOperationNode>('*', root->clone(), other.root->clone()));
+    return Expression(std::make_shared<BinaryOperationNode>('*', root, other.root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::operator/(const Expression& other) const {
-    return Expression(std::make_unique<BinaryOperationNode>('/', root->clone(), other.root->clone()));
+    return Expression(std::make_shared<BinaryOperationNode>('/', root, other.root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::operator^(const Expression& other) const {
-    return Expression(std::make_unique<BinaryOperationNode>('^', root->clone(), other.root->clone()));
+    return Expression(std::make_shared<BinaryOperationNode>('^', root, other.root));
+}
+
+template<typename T>
+Expression<T> Expression<T>::operator-() const {
+    return Expression(std::make_shared<UnaryOperationNode>(Function::Negate, root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::sin() const {
-    return Expression(std::make_unique<UnaryOperationNode>("sin", root->clone()));
+    return Expression(std::make_shared<UnaryOperationNode>(Function::Sin, root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::cos() const {
-    return Expression(std::make_unique<UnaryOperationNode>("cos", root->clone()));
+    return Expression(std::make_shared<UnaryOperationNode>(Function::Cos, root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::ln() const {
-    return Expression(std::make_unique<UnaryOperationNode>("ln", root->clone()));
+    return Expression(std::make_shared<UnaryOperationNode>(Function::Ln, root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::exp() const {
-    return Expression(std::make_unique<UnaryOperationNode>("exp", root->clone()));
+    return Expression(std::make_shared<UnaryOperationNode>(Function::Exp, root));
 }
 
 template<typename T>
 Expression<T> Expression<T>::substitute(const std::string& variable, T value) const {
-    auto newRoot = root->substitute(variable, value);
+    NodeMemo memo;
+    auto newRoot = substituteNode(root, variable, value, memo);
     return Expression(std::move(newRoot));
 }
 
 template<typename T>
 std::optional<T> Expression<T>::evaluate(const std::map<std::string, T>& variables) const {
-    return root->evaluate(variables);
+    EXPRESSION_PROFILE_PHASE(evaluateNanoseconds);
+    return evaluateNode(*root, variables);
+}
+
+template<typename T>
+std::optional<std::vector<T>> Expression<T>::evaluateBatch(const std::map<std::string, std::vector<T>>& variables) const {
+    EXPRESSION_PROFILE_PHASE(evaluateNanoseconds);
+    size_t count = variables.empty() ? 1 : variables.begin()->second.size();
+    for (const auto& [name, values] : variables) {
+        if (values.size() != count) {
+            throw std::invalid_argument("столбцы переменных разной длины");
+        }
+    }
+    std::vector<T> result;
+    if (!evaluateBatchNode(*root, variables, count, result)) {
+        return std::nullopt;
+    }
+    return result;
 }
 
 template<typename T>
 std::string Expression<T>::toString() const {
-    return root->toString();
+    if (activeBudget && root->weight > activeBudget->treeLimit) {
+        throw std::length_error("выражение слишком велико для записи строкой");
+    }
+    return toStringNode(*root, nullptr);
 }
 
 template<typename T>
 std::string Expression<T>::toStringWithSubstitution(const std::map<std::string, T>& variables) const {
-    return root->toStringWithSubstitution(variables);
+    if (activeBudget && root->weight > activeBudget->treeLimit) {
+        throw std::length_error("выражение слишком велико для записи строкой");
+    }
+    return toStringNode(*root, &variables);
 }
 
 template<typename T>
 Expression<T> Expression<T>::fromString(const std::string& expr) {
+    EXPRESSION_PROFILE_PHASE(parseNanoseconds);
     size_t pos = 0;
     auto node = parseExpression(expr, pos);
     return Expression(std::move(node));
@@ -111,357 +265,2903 @@ Expression<T> Expression<T>::fromString(const std::string& expr) {
 
 template<typename T>
 Expression<T> Expression<T>::differentiate(const std::string& variable) const {
-    auto diffRoot = root->differentiate(variable);
-    return Expression(std::move(diffRoot));
+    EXPRESSION_PROFILE_PHASE(differentiateNanoseconds);
+    auto& derivatives = derivativeCache();
+    std::lock_guard<std::mutex> lock(derivatives.mutex);
+    auto& entry = derivatives.entries[variable];
+    if (entry.derivative) {
+        ++cacheHits;
+        return *entry.derivative;
+    }
+    ++cacheMisses;
+    derivatives.differentiate(root, variable, entry);
+    return *entry.derivative;
 }
 
 template<typename T>
-std::optional<T> Expression<T>::BinaryOperationNode::evaluate(const std::map<std::string, T>& variables) const {
-    auto leftVal = left->evaluate(variables);
-    auto rightVal = right->evaluate(variables);
-
-    if (!leftVal || !rightVal) {
-        return std::nullopt;
+Expression<T> Expression<T>::simplifiedDerivative(const std::string& variable) const {
+    auto& derivatives = derivativeCache();
+    std::lock_guard<std::mutex> lock(derivatives.mutex);
+    auto& entry = derivatives.entries[variable];
+    if (entry.simplified) {
+        ++cacheHits;
+        return *entry.simplified;
     }
+    ++cacheMisses;
+    derivatives.simplify(root, variable, entry);
+    return *entry.simplified;
+}
 
-    switch (op) {
-        case '+': return *leftVal + *rightVal;
-        case '-': return *leftVal - *rightVal;
-        case '*': return *leftVal * *rightVal;
-        case '/': return *leftVal / *rightVal;
-        case '^': return std::pow(*leftVal, *rightVal);
-        default: throw std::invalid_argument("неизвестный оператор");
+template<typename T>
+std::shared_ptr<const ExpressionSet<T>> Expression<T>::compiledDerivative(const std::string& variable) const {
+    auto& derivatives = derivativeCache();
+    std::lock_guard<std::mutex> lock(derivatives.mutex);
+    auto& entry = derivatives.entries[variable];
+    if (entry.compiled) {
+        ++cacheHits;
+        return entry.compiled;
     }
+    ++cacheMisses;
+    derivatives.simplify(root, variable, entry);
+    entry.compiled = std::make_shared<const ExpressionSet<T>>(std::vector<Expression>{*entry.simplified});
+    return entry.compiled;
 }
 
 template<typename T>
-std::string Expression<T>::BinaryOperationNode::toString() const {
-    std::string leftStr = left->toString();
-    std::string rightStr = right->toString();
-
-    if (left->precedence() < this->precedence()) {
-        leftStr = "(" + leftStr + ")";
+uint64_t Expression<T>::DerivativeCache::dependencyMask(const Node& node) {
+    auto cached = dependencies.find(&node);
+    if (cached != dependencies.end()) {
+        return cached->second;
     }
-    if (right->precedence() < this->precedence()) {
-        rightStr = "(" + rightStr + ")";
+    uint64_t mask = 0;
+    switch (node.kind) {
+        case Kind::Constant:
+            break;
+        case Kind::Variable: {
+            auto it = std::lower_bound(names.begin(), names.end(), static_cast<const VariableNode&>(node).name);
+            mask = uint64_t(1) << (it - names.begin());
+            break;
+        }
+        case Kind::BinaryOperation:
+            mask = dependencyMask(*static_cast<const BinaryOperationNode&>(node).left) |
+                   dependencyMask(*static_cast<const BinaryOperationNode&>(node).right);
+            break;
+        case Kind::UnaryOperation:
+            mask = dependencyMask(*static_cast<const UnaryOperationNode&>(node).operand);
+            break;
+        case Kind::FunctionCall:
+            for (const auto& argument : static_cast<const FunctionNode&>(node).arguments) {
+                mask |= dependencyMask(*argument);
+            }
+            break;
+        case Kind::Polynomial:
+            mask = dependencyMask(*static_cast<const PolynomialNode&>(node).base);
+            break;
     }
-
-    return leftStr + " " + op + " " + rightStr;
+    dependencies.emplace(&node, mask);
+    return mask;
 }
 
 template<typename T>
-std::string Expression<T>::BinaryOperationNode::toStringWithSubstitution(const std::map<std::string, T>& variables) const {
-    std::string leftStr = left->toStringWithSubstitution(variables);
-    std::string rightStr = right->toStringWithSubstitution(variables);
-
-    if (left->precedence() < this->precedence()) {
-        leftStr = "(" + leftStr + ")";
+void Expression<T>::DerivativeCache::seed(const NodePtr& node, uint64_t bit, NodeMemo& memo) {
+    if (memo.count(node.get())) {
+        return;
+    }
+    if (!(dependencyMask(*node) & bit)) {
+        memo.emplace(node.get(), zeroNode());
+        return;
     }
-    if (right->precedence() < this->precedence()) {
-        rightStr = "(" + rightStr + ")";
+    switch (node->kind) {
+        case Kind::Constant:
+        case Kind::Variable:
+            break;
+        case Kind::BinaryOperation:
+            seed(static_cast<const BinaryOperationNode&>(*node).left, bit, memo);
+            seed(static_cast<const BinaryOperationNode&>(*node).right, bit, memo);
+            break;
+        case Kind::UnaryOperation:
+            seed(static_cast<const UnaryOperationNode&>(*node).operand, bit, memo);
+            break;
+        case Kind::FunctionCall:
+            for (const auto& argument : static_cast<const FunctionNode&>(*node).arguments) {
+                seed(argument, bit, memo);
+            }
+            break;
+        case Kind::Polynomial:
+            seed(static_cast<const PolynomialNode&>(*node).base, bit, memo);
+            break;
     }
+}
 
-    return leftStr + " " + op + " " + rightStr;
+template<typename T>
+void Expression<T>::DerivativeCache::differentiate(const NodePtr& root, const std::string& variable, Entry& entry) {
+    if (entry.derivative) {
+        return;
+    }
+    if (!analysed) {
+        names = Expression(root).variables();
+        analysed = true;
+    }
+    auto it = std::lower_bound(names.begin(), names.end(), variable);
+    NodePtr result;
+    if (it != names.end() && *it == variable) {
+        NodeMemo memo;
+        if (names.size() <= 64) {
+            seed(root, uint64_t(1) << (it - names.begin()), memo);
+        }
+        result = differentiateNode(root, variable, memo);
+    } else {
+        result = zeroNode();
+    }
+    entry.derivative = Expression(std::move(result), std::make_shared<DerivativeCache>());
 }
 
 template<typename T>
-std::optional<T> Expression<T>::UnaryOperationNode::evaluate(const std::map<std::string, T>& variables) const {
-    auto val = operand->evaluate(variables);
-    if (!val) {
-        return std::nullopt;
+void Expression<T>::DerivativeCache::simplify(const NodePtr& root, const std::string& variable, Entry& entry) {
+    if (entry.simplified) {
+        return;
     }
+    differentiate(root, variable, entry);
+    entry.simplified = Expression(entry.derivative->simplify().root, std::make_shared<DerivativeCache>());
+}
 
-    if (func == "sin") return std::sin(*val);
-    if (func == "cos") return std::cos(*val);
-    if (func == "ln") return std::log(*val);
-    if (func == "exp") return std::exp(*val);
-    throw std::invalid_argument("неизвестная функция");
+template<typename T>
+std::vector<Expression<T>> Expression<T>::differentiateAll(const std::vector<Expression>& expressions, const std::string& variable) {
+    EXPRESSION_PROFILE_PHASE(differentiateNanoseconds);
+    NodeMemo memo;
+    std::vector<Expression> result;
+    result.reserve(expressions.size());
+    for (const auto& expr : expressions) {
+        result.push_back(Expression(differentiateNode(expr.root, variable, memo)));
+    }
+    return result;
 }
 
 template<typename T>
-std::string Expression<T>::UnaryOperationNode::toString() const {
-    return func + "(" + operand->toString() + ")";
+std::vector<std::string> Expression<T>::variables() const {
+    std::vector<const Node*> pending = {root.get()};
+    std::unordered_set<const Node*> visited;
+    std::set<std::string> names;
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        if (!visited.insert(node).second) {
+            continue;
+        }
+        switch (node->kind) {
+            case Kind::Constant:
+                break;
+            case Kind::Variable:
+                names.insert(static_cast<const VariableNode*>(node)->name);
+                break;
+            case Kind::BinaryOperation:
+                pending.push_back(static_cast<const BinaryOperationNode*>(node)->left.get());
+                pending.push_back(static_cast<const BinaryOperationNode*>(node)->right.get());
+                break;
+            case Kind::UnaryOperation:
+                pending.push_back(static_cast<const UnaryOperationNode*>(node)->operand.get());
+                break;
+            case Kind::FunctionCall:
+                for (const auto& argument : static_cast<const FunctionNode*>(node)->arguments) {
+                    pending.push_back(argument.get());
+                }
+                break;
+            case Kind::Polynomial:
+                pending.push_back(static_cast<const PolynomialNode*>(node)->base.get());
+                break;
+        }
+    }
+    return std::vector<std::string>(names.begin(), names.end());
 }
 
 template<typename T>
-std::string Expression<T>::UnaryOperationNode::toStringWithSubstitution(const std::map<std::string, T>& variables) const {
-    return func + "(" + operand->toStringWithSubstitution(variables) + ")";
+typename Expression<T>::Statistics Expression<T>::statistics() const {
+    StatisticsMemo memo;
+    return collectNode(*root, memo);
 }
 
 template<typename T>
-std::optional<T> Expression<T>::VariableNode::evaluate(const std::map<std::string, T>& variables) const {
-    auto it = variables.find(name);
-    if (it != variables.end()) {
-        return it->second;
+typename Expression<T>::Footprint Expression<T>::footprint() const {
+    Footprint result;
+    result.treeNodes = root->weight;
+    std::vector<const Node*> pending = {root.get()};
+    std::unordered_set<const Node*> visited;
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        if (!visited.insert(node).second) {
+            continue;
+        }
+        result.nodes++;
+        result.bytes += nodeBytes(*node);
+        switch (node->kind) {
+            case Kind::Constant:
+            case Kind::Variable:
+                break;
+            case Kind::BinaryOperation:
+                pending.push_back(static_cast<const BinaryOperationNode*>(node)->left.get());
+                pending.push_back(static_cast<const BinaryOperationNode*>(node)->right.get());
+                break;
+            case Kind::UnaryOperation:
+                pending.push_back(static_cast<const UnaryOperationNode*>(node)->operand.get());
+                break;
+            case Kind::FunctionCall:
+                for (const auto& argument : static_cast<const FunctionNode*>(node)->arguments) {
+                    pending.push_back(argument.get());
+                }
+                break;
+            case Kind::Polynomial:
+                pending.push_back(static_cast<const PolynomialNode*>(node)->base.get());
+                break;
+        }
     }
-    return std::nullopt;
+    return result;
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::VariableNode::substitute(const std::string& variable, T value) {
-    if (name == variable) {
-        return std::make_unique<ConstantNode>(value);
+size_t Expression<T>::nodeBytes(const Node& node) {
+    switch (node.kind) {
+        case Kind::Constant:
+            return sizeof(ConstantNode) + sharedOverhead;
+        case Kind::Variable:
+            return sizeof(VariableNode) + sharedOverhead + static_cast<const VariableNode&>(node).name.size();
+        case Kind::BinaryOperation:
+            return sizeof(BinaryOperationNode) + sharedOverhead;
+        case Kind::UnaryOperation:
+            return sizeof(UnaryOperationNode) + sharedOverhead;
+        case Kind::FunctionCall:
+            return sizeof(FunctionNode) + sharedOverhead + static_cast<const FunctionNode&>(node).arguments.size() * sizeof(NodePtr);
+        case Kind::Polynomial:
+            return sizeof(PolynomialNode) + sharedOverhead + static_cast<const PolynomialNode&>(node).terms.size() * sizeof(std::pair<unsigned, T>);
     }
-    return clone();
+    return 0;
 }
 
 template<typename T>
-Expression<T> Expression<T>::simplify() const {
-    auto simplifiedRoot = simplifyNode(root->clone());
-    return Expression(std::move(simplifiedRoot));
+Expression<T>::BudgetScope::BudgetScope(Budget budget)
+    : budget(budget), treeLimit(activeBudget ? std::min(budget.treeNodes, activeBudget->treeLimit) : budget.treeNodes),
+      previous(activeBudget) {
+    activeBudget = this;
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::simplifyNode(std::unique_ptr<Node> node) {
-    if (auto binaryNode = dynamic_cast<BinaryOperationNode*>(node.get())) {
-        auto left = simplifyNode(std::move(binaryNode->left));
-        auto right = simplifyNode(std::move(binaryNode->right));
-
-        if (binaryNode->op == '*' && (left->toString() == "0.000000" || right->toString() == "0.000000")) {
-            return std::make_unique<ConstantNode>(0);
-        }
+Expression<T>::BudgetScope::~BudgetScope() {
+    activeBudget = previous;
+}
 
-        if (binaryNode->op == '*' && left->toString() == "1.000000") {
-            return right;
+template<typename T>
+void Expression<T>::BudgetScope::charge(size_t bytes, uint32_t weight) {
+    for (BudgetScope* scope = this; scope; scope = scope->previous) {
+        scope->usedNodes++;
+        scope->usedBytes += bytes;
+        if (scope->usedNodes > scope->budget.nodes || scope->usedBytes > scope->budget.bytes) {
+            throw std::length_error("превышен бюджет памяти выражения");
         }
-        if (binaryNode->op == '*' && right->toString() == "1.000000") {
-            return left;
+        if (weight > scope->budget.treeNodes) {
+            if (!scope->budget.shareOversizedTrees) {
+                throw std::length_error("превышен бюджет размера дерева выражения");
+            }
+            scope->oversized = true;
         }
+    }
+}
 
-        if (binaryNode->op == '*' && dynamic_cast<ConstantNode*>(left.get()) && dynamic_cast<ConstantNode*>(right.get())) {
-            T leftValue = dynamic_cast<ConstantNode*>(left.get())->value;
-            T rightValue = dynamic_cast<ConstantNode*>(right.get())->value;
-            return std::make_unique<ConstantNode>(leftValue * rightValue);
-        }
+template<typename T>
+bool Expression<T>::profilingEnabled() {
+#ifdef EXPRESSION_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
 
-        if (binaryNode->op == '+' && left->toString() == "0.000000") {
-            return right;
-        }
-        if (binaryNode->op == '+' && right->toString() == "0.000000") {
-            return left;
-        }
+template<typename T>
+typename Expression<T>::Profile Expression<T>::profile() {
+    Profile result;
+#ifdef EXPRESSION_PROFILING
+    result.allocations = counters.allocations;
+    result.parseSeconds = counters.parseNanoseconds * 1e-9;
+    result.simplifySeconds = counters.simplifyNanoseconds * 1e-9;
+    result.differentiateSeconds = counters.differentiateNanoseconds * 1e-9;
+    result.evaluateSeconds = counters.evaluateNanoseconds * 1e-9;
+#endif
+    return result;
+}
 
-        if (binaryNode->op == '*' && dynamic_cast<BinaryOperationNode*>(left.get()) && left->toString().find('*') != std::string::npos) {
-            left = simplifyNode(std::move(left));
-        }
-        if (binaryNode->op == '*' && dynamic_cast<BinaryOperationNode*>(right.get()) && right->toString().find('*') != std::string::npos) {
-            right = simplifyNode(std::move(right));
-        }
+template<typename T>
+void Expression<T>::resetProfile() {
+#ifdef EXPRESSION_PROFILING
+    counters.allocations = 0;
+    counters.parseNanoseconds = 0;
+    counters.simplifyNanoseconds = 0;
+    counters.differentiateNanoseconds = 0;
+    counters.evaluateNanoseconds = 0;
+#endif
+}
 
-        return std::make_unique<BinaryOperationNode>(binaryNode->op, std::move(left), std::move(right));
-    }
+template<typename T>
+typename Expression<T>::CacheStatistics Expression<T>::cacheStatistics() {
+    CacheStatistics result;
+    result.hits = cacheHits;
+    result.misses = cacheMisses;
+    return result;
+}
 
-    if (auto unaryNode = dynamic_cast<UnaryOperationNode*>(node.get())) {
-        auto operand = simplifyNode(std::move(unaryNode->operand));
-        return std::make_unique<UnaryOperationNode>(unaryNode->func, std::move(operand));
-    }
+template<typename T>
+void Expression<T>::resetCacheStatistics() {
+    cacheHits = 0;
+    cacheMisses = 0;
+}
 
-    return node->clone();
+template<typename T>
+typename Expression<T>::FunctionRegistry& Expression<T>::registry() {
+    static FunctionRegistry instance;
+    static std::once_flag initialized;
+    std::call_once(initialized, [] { registerBuiltinFunctions(instance); });
+    return instance;
 }
 
 template<typename T>
-void Expression<T>::skipWhitespace(const std::string& expr, size_t& pos) {
-    while (pos < expr.size() && std::isspace(expr[pos])) {
-        pos++;
+void Expression<T>::registerBuiltinFunctions(FunctionRegistry& registry) {
+    auto unary = [](T (*kernel)(const T&)) {
+        return std::function<void(const T* const*, T*, size_t)>([kernel](const T* const* arguments, T* result, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                result[i] = kernel(arguments[0][i]);
+            }
+        });
+    };
+
+    FunctionDefinition tan;
+    tan.name = "tan";
+    tan.evaluate = [](const T* a) { return T(std::tan(a[0])); };
+    tan.evaluateBatch = unary([](const T& x) { return T(std::tan(x)); });
+    tan.partialDerivative = [](const std::vector<Expression>& a, size_t) {
+        return Expression(T(1)) + (call("tan", a) ^ Expression(T(2)));
+    };
+    addFunction(registry, std::move(tan));
+
+    FunctionDefinition sqrt;
+    sqrt.name = "sqrt";
+    sqrt.evaluate = [](const T* a) { return T(std::sqrt(a[0])); };
+    sqrt.evaluateBatch = unary([](const T& x) { return T(std::sqrt(x)); });
+    sqrt.partialDerivative = [](const std::vector<Expression>& a, size_t) {
+        return Expression(T(1)) / (Expression(T(2)) * call("sqrt", a));
+    };
+    addFunction(registry, std::move(sqrt));
+
+    // sign(0) = 0: производные abs, min и max в изломе берутся как субградиент, а не 0 / 0.
+    auto signum = [](const T& x) { return x == T(0) ? T(0) : x / T(std::abs(x)); };
+    FunctionDefinition sign;
+    sign.name = "sign";
+    sign.evaluate = [signum](const T* a) { return signum(a[0]); };
+    sign.evaluateBatch = unary(signum);
+    sign.partialDerivative = [](const std::vector<Expression>&, size_t) {
+        return Expression(T(0));
+    };
+    addFunction(registry, std::move(sign));
+
+    FunctionDefinition abs;
+    abs.name = "abs";
+    abs.evaluate = [](const T* a) { return T(std::abs(a[0])); };
+    abs.evaluateBatch = unary([](const T& x) { return T(std::abs(x)); });
+    abs.partialDerivative = [](const std::vector<Expression>& a, size_t) {
+        return call("sign", a);
+    };
+    addFunction(registry, std::move(abs));
+
+    if constexpr (!IsComplex<T>::value) {
+        FunctionDefinition atan2;
+        atan2.name = "atan2";
+        atan2.arity = 2;
+        atan2.evaluate = [](const T* a) { return std::atan2(a[0], a[1]); };
+        atan2.evaluateBatch = [](const T* const* a, T* result, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                result[i] = std::atan2(a[0][i], a[1][i]);
+            }
+        };
+        atan2.partialDerivative = [](const std::vector<Expression>& a, size_t index) {
+            auto norm = (a[0] ^ Expression(T(2))) + (a[1] ^ Expression(T(2)));
+            return index == 0 ? a[1] / norm : -a[0] / norm;
+        };
+        addFunction(registry, std::move(atan2));
+
+        // Через |a - b|: min(a, b) = (a + b - |a - b|) / 2, max(a, b) = (a + b + |a - b|) / 2;
+        // при a == b каждая частная производная равна 1 / 2.
+        auto extremum = [](const std::string& name, T sign) {
+            FunctionDefinition definition;
+            definition.name = name;
+            definition.arity = 2;
+            if (sign < 0) {
+                definition.evaluate = [](const T* a) { return std::min(a[0], a[1]); };
+                definition.evaluateBatch = [](const T* const* a, T* result, size_t count) {
+                    for (size_t i = 0; i < count; ++i) {
+                        result[i] = std::min(a[0][i], a[1][i]);
+                    }
+                };
+            } else {
+                definition.evaluate = [](const T* a) { return std::max(a[0], a[1]); };
+                definition.evaluateBatch = [](const T* const* a, T* result, size_t count) {
+                    for (size_t i = 0; i < count; ++i) {
+                        result[i] = std::max(a[0][i], a[1][i]);
+                    }
+                };
+            }
+            definition.partialDerivative = [sign](const std::vector<Expression>& a, size_t index) {
+                auto step = call("sign", {a[0] - a[1]});
+                T direction = index == 0 ? sign : -sign;
+                return (Expression(T(1)) + Expression(direction) * step) / Expression(T(2));
+            };
+            return definition;
+        };
+        addFunction(registry, extremum("min", T(-1)));
+        addFunction(registry, extremum("max", T(1)));
     }
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::parseExpression(const std::string& expr, size_t& pos) {
-    auto left = parseTerm(expr, pos);
-    skipWhitespace(expr, pos);
-
-    while (pos < expr.size()) {
-        char op = expr[pos];
-        if (op != '+' && op != '-') break;
-        pos++;
-        skipWhitespace(expr, pos);
-        auto right = parseTerm(expr, pos);
-        left = std::make_unique<BinaryOperationNode>(op, std::move(left), std::move(right));
-        skipWhitespace(expr, pos);
+int Expression<T>::addFunction(FunctionRegistry& registry, FunctionDefinition definition) {
+    if (definition.name.empty() || !std::isalpha(static_cast<unsigned char>(definition.name[0]))) {
+        throw std::invalid_argument("некорректное имя функции");
     }
-    return left;
+    if (functionFromName(definition.name) || registry.ids.count(definition.name)) {
+        throw std::invalid_argument("функция уже зарегистрирована: " + definition.name);
+    }
+    if (!definition.evaluate) {
+        throw std::invalid_argument("не задано вычисление функции: " + definition.name);
+    }
+    int id = static_cast<int>(registry.definitions.size());
+    registry.ids[definition.name] = id;
+    registry.definitions.push_back(std::move(definition));
+    return id;
 }
 
+// Без evaluateBatch значения точки собираются в point (arity элементов от вызывающего),
+// поэтому evaluateBound не выделяет память и для таких функций.
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::parseTerm(const std::string& expr, size_t& pos) {
-    auto left = parseFactor(expr, pos);
-    skipWhitespace(expr, pos);
-
-    while (pos < expr.size()) {
-        char op = expr[pos];
-        if (op != '*' && op != '/') break;
-        pos++;
-        skipWhitespace(expr, pos);
-        auto right = parseFactor(expr, pos);
-        left = std::make_unique<BinaryOperationNode>(op, std::move(left), std::move(right));
-        skipWhitespace(expr, pos);
+void Expression<T>::applyFunctionBatch(const FunctionDefinition& definition, const T* const* arguments, T* result, size_t count, T* point) {
+    if (definition.evaluateBatch) {
+        definition.evaluateBatch(arguments, result, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < definition.arity; ++k) {
+            point[k] = arguments[k][i];
+        }
+        result[i] = definition.evaluate(point);
     }
-    return left;
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::parseFactor(const std::string& expr, size_t& pos) {
-    auto left = parseUnary(expr, pos);
-    skipWhitespace(expr, pos);
+int Expression<T>::registerFunction(FunctionDefinition definition) {
+    auto& functions = registry();
+    std::lock_guard<std::mutex> lock(functions.mutex);
+    return addFunction(functions, std::move(definition));
+}
 
-    while (pos < expr.size() && expr[pos] == '^') {
-        pos++;
-        skipWhitespace(expr, pos);
-        auto right = parseUnary(expr, pos);
-        left = std::make_unique<BinaryOperationNode>('^', std::move(left), std::move(right));
-        skipWhitespace(expr, pos);
+template<typename T>
+std::optional<int> Expression<T>::functionId(const std::string& name) {
+    int id;
+    if (!lookupFunction(name, id)) {
+        return std::nullopt;
     }
-    return left;
+    return id;
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::parseUnary(const std::string& expr, size_t& pos) {
-    skipWhitespace(expr, pos);
-
-    if (expr[pos] == '-') {
-        pos++;
-        skipWhitespace(expr, pos);
-        auto operand = parseUnary(expr, pos);
-        return std::make_unique<UnaryOperationNode>("-", std::move(operand));
+const typename Expression<T>::FunctionDefinition* Expression<T>::lookupFunction(const std::string& name, int& id) {
+    auto& functions = registry();
+    std::lock_guard<std::mutex> lock(functions.mutex);
+    auto it = functions.ids.find(name);
+    if (it == functions.ids.end()) {
+        return nullptr;
     }
-
-    return parsePrimary(expr, pos);
+    id = it->second;
+    return &functions.definitions[id];
 }
 
 template<typename T>
-std::unique_ptr<typename Expression<T>::Node> Expression<T>::parsePrimary(const std::string& expr, size_t& pos) {
-    skipWhitespace(expr, pos);
-
-    if (expr[pos] == '-') {
-        pos++;
-        skipWhitespace(expr, pos);
-        auto operand = parsePrimary(expr, pos);
-        return std::make_unique<UnaryOperationNode>("-", std::move(operand));
+Expression<T> Expression<T>::call(const std::string& name, const std::vector<Expression>& arguments) {
+    int id;
+    auto definition = lookupFunction(name, id);
+    if (!definition) {
+        throw std::invalid_argument("неизвестная функция: " + name);
     }
+    if (arguments.size() != definition->arity) {
+        throw std::invalid_argument("неверное число аргументов функции " + name);
+    }
+    std::vector<NodePtr> nodes;
+    for (const auto& argument : arguments) {
+        nodes.push_back(argument.root);
+    }
+    return Expression(std::make_shared<FunctionNode>(id, definition, std::move(nodes)));
+}
 
-    if (expr[pos] == '(') {
-        pos++;
-        skipWhitespace(expr, pos);
-
-        auto realPart = parseExpression(expr, pos);
-        skipWhitespace(expr, pos);
-
-        if (pos < expr.size() && (expr[pos] == '+' || expr[pos] == '-')) {
-            char sign = expr[pos];
-            pos++;
-            skipWhitespace(expr, pos);
-            auto imaginaryPart = parseExpression(expr, pos);
-            skipWhitespace(expr, pos);
-            if (pos >= expr.size() || expr[pos] != 'i') {
-                throw std::invalid_argument("ожидается 'i' в мнимой части");
-            }
-            pos++;
-            skipWhitespace(expr, pos);
-
-            if (expr[pos] != ')') {
-                throw std::invalid_argument("нужна вторая скобка");
-            }
-            pos++;
-            skipWhitespace(expr, pos);
-            if (sign == '+') {
-                return std::make_unique<BinaryOperationNode>('+', std::move(realPart), std::move(imaginaryPart));
-            } else {
-                return std::make_unique<BinaryOperationNode>('-', std::move(realPart), std::move(imaginaryPart));
+template<typename T>
+bool Expression<T>::evaluateBatchNode(const Node& node, const std::map<std::string, std::vector<T>>& variables, size_t count, std::vector<T>& result) {
+    switch (node.kind) {
+        case Kind::Constant:
+            result.assign(count, static_cast<const ConstantNode&>(node).value);
+            return true;
+        case Kind::Variable: {
+            auto it = variables.find(static_cast<const VariableNode&>(node).name);
+            if (it == variables.end()) {
+                return false;
             }
-        } else {
-            if (expr[pos] != ')') {
-                throw std::invalid_argument("нужна вторая скобка");
+            result = it->second;
+            return true;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(node);
+            std::vector<T> right;
+            if (!evaluateBatchNode(*binary.left, variables, count, result) || !evaluateBatchNode(*binary.right, variables, count, right)) {
+                return false;
             }
-            pos++;
-            skipWhitespace(expr, pos);
-            return realPart;
+            applyBinaryBatch(binary.op, result.data(), right.data(), result.data(), count);
+            return true;
         }
-    }
-
-    if (std::isdigit(expr[pos]) || expr[pos] == '.') {
-        std::string numStr;
-        while (pos < expr.size() && (std::isdigit(expr[pos]) || expr[pos] == '.')) {
-            numStr += expr[pos++];
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(node);
+            if (!evaluateBatchNode(*unary.operand, variables, count, result)) {
+                return false;
+            }
+            applyUnaryBatch(unary.func, result.data(), result.data(), count);
+            return true;
         }
-        skipWhitespace(expr, pos);
-
-        T value;
-        if constexpr (std::is_same_v<T, std::complex<double>>) {
-            value = std::complex<double>(std::stod(numStr), 0);
-        } else {
-            value = static_cast<T>(std::stod(numStr));
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(node);
+            std::vector<std::vector<T>> columns(function.arguments.size());
+            std::vector<const T*> pointers;
+            for (size_t k = 0; k < columns.size(); ++k) {
+                if (!evaluateBatchNode(*function.arguments[k], variables, count, columns[k])) {
+                    return false;
+                }
+                pointers.push_back(columns[k].data());
+            }
+            result.resize(count);
+            std::vector<T> point(columns.size());
+            applyFunctionBatch(*function.definition, pointers.data(), result.data(), count, point.data());
+            return true;
         }
-
-        if (pos < expr.size() && (std::isalpha(expr[pos]) || expr[pos] == '(')) {
-            auto left = std::make_unique<ConstantNode>(value);
-            auto right = parsePrimary(expr, pos);
-            return std::make_unique<BinaryOperationNode>('*', std::move(left), std::move(right));
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(node);
+            if (!evaluateBatchNode(*polynomial.base, variables, count, result)) {
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                result[i] = evaluatePolynomial(polynomial, result[i]);
+            }
+            return true;
         }
-
-        return std::make_unique<ConstantNode>(value);
     }
+    throw std::invalid_argument("неизвестный узел");
+}
 
-    if (std::isalpha(expr[pos])) {
-        std::string token;
-        while (pos < expr.size() && std::isalpha(expr[pos])) {
-            token += expr[pos++];
-        }
-        skipWhitespace(expr, pos);
-
-        if (token == "sin" || token == "cos" || token == "ln" || token == "exp") {
-            if (expr[pos] != '(') {
-                throw std::invalid_argument("нужна первая скобка после функции");
-            }
-            pos++;
-            skipWhitespace(expr, pos);
-            auto operand = parseExpression(expr, pos);
-            skipWhitespace(expr, pos);
-            if (expr[pos] != ')') {
-                throw std::invalid_argument("нужна вторая скобка после аргумента функции");
-            }
-            pos++;
-            skipWhitespace(expr, pos);
-            return std::make_unique<UnaryOperationNode>(token, std::move(operand));
+template<typename T>
+T Expression<T>::integerPower(T base, unsigned exponent) {
+    T result(1);
+    while (exponent > 0) {
+        if (exponent & 1u) {
+            result *= base;
         }
-        if (token == "i") {
-            if constexpr (std::is_same_v<T, std::complex<double>>) {
-                return std::make_unique<ConstantNode>(std::complex<double>(0, 1));
-            } else {
-                throw std::invalid_argument("мнимая единица поддерживается только для std::complex<double>");
-            }
+        exponent >>= 1;
+        if (exponent > 0) {
+            base *= base;
         }
-
-        return std::make_unique<VariableNode>(token);
     }
-
-    throw std::invalid_argument("неизвестный символ");
+    return result;
 }
 
+// Целые показатели (в том числе переменные, принявшие целое значение) возводятся
+// повторным возведением в квадрат: это быстрее std::pow и точно для малых степеней.
 template<typename T>
-void printResult(const T& value) {
-    std::cout << value << std::endl;
+T Expression<T>::power(const T& base, const T& exponent) {
+    auto real = std::real(exponent);
+    if (std::imag(exponent) == 0 && real == std::trunc(real) && std::fabs(real) <= 64) {
+        T result = integerPower(base, static_cast<unsigned>(std::fabs(real)));
+        return real < 0 ? T(1) / result : result;
+    }
+    return std::pow(base, exponent);
 }
 
-template<>
-void printResult<std::complex<double>>(const std::complex<double>& value) {
-    if (value.imag() == 0) {
-        std::cout << value.real() << std::endl;
-    } else {
-        std::cout << "(" << value.real() << ", " << value.imag() << ")" << std::endl;
+// Схема Горнера по разреженным слагаемым: пропуски степеней закрываются integerPower.
+template<typename T>
+T Expression<T>::evaluatePolynomial(const PolynomialNode& polynomial, const T& base) {
+    const auto& terms = polynomial.terms;
+    T result = terms.front().second;
+    for (size_t k = 1; k < terms.size(); ++k) {
+        unsigned gap = terms[k - 1].first - terms[k].first;
+        result = result * (gap == 1 ? base : integerPower(base, gap)) + terms[k].second;
     }
+    unsigned lowest = terms.back().first;
+    return lowest == 0 ? result : result * integerPower(base, lowest);
 }
 
-template<>
-std::string Expression<std::complex<double>>::ConstantNode::toString() const {
-    std::ostringstream oss;
-    if (value.imag() == 0) {
-        oss << value.real();
-    } else {
-        oss << "(" << value.real() << ", " << value.imag() << ")";
+template<typename T>
+T Expression<T>::applyBinary(char op, const T& left, const T& right) {
+    switch (op) {
+        case '+': return left + right;
+        case '-': return left - right;
+        case '*': return left * right;
+        case '/': return left / right;
+        case '^': return power(left, right);
+        default: throw std::invalid_argument("неизвестный оператор");
+    }
+}
+
+template<typename T>
+T Expression<T>::applyUnary(Function func, const T& value) {
+    switch (func) {
+        case Function::Negate: return -value;
+        case Function::Sin: return std::sin(value);
+        case Function::Cos: return std::cos(value);
+        case Function::Ln: return std::log(value);
+        case Function::Exp: return std::exp(value);
+    }
+    throw std::invalid_argument("неизвестная функция");
+}
+
+template<typename T>
+void Expression<T>::applyBinaryBatch(char op, const T* left, const T* right, T* result, size_t count) {
+    switch (op) {
+        case '+': for (size_t i = 0; i < count; ++i) result[i] = left[i] + right[i]; return;
+        case '-': for (size_t i = 0; i < count; ++i) result[i] = left[i] - right[i]; return;
+        case '*': for (size_t i = 0; i < count; ++i) result[i] = left[i] * right[i]; return;
+        case '/': for (size_t i = 0; i < count; ++i) result[i] = left[i] / right[i]; return;
+        case '^': for (size_t i = 0; i < count; ++i) result[i] = power(left[i], right[i]); return;
+        default: throw std::invalid_argument("неизвестный оператор");
+    }
+}
+
+template<typename T>
+void Expression<T>::applyUnaryBatch(Function func, const T* operand, T* result, size_t count) {
+    switch (func) {
+        case Function::Negate: for (size_t i = 0; i < count; ++i) result[i] = -operand[i]; return;
+        case Function::Sin: for (size_t i = 0; i < count; ++i) result[i] = std::sin(operand[i]); return;
+        case Function::Cos: for (size_t i = 0; i < count; ++i) result[i] = std::cos(operand[i]); return;
+        case Function::Ln: for (size_t i = 0; i < count; ++i) result[i] = std::log(operand[i]); return;
+        case Function::Exp: for (size_t i = 0; i < count; ++i) result[i] = std::exp(operand[i]); return;
+    }
+    throw std::invalid_argument("неизвестная функция");
+}
+
+template<typename T>
+std::optional<T> Expression<T>::evaluateNode(const Node& node, const std::map<std::string, T>& variables) {
+    switch (node.kind) {
+        case Kind::Constant:
+            return static_cast<const ConstantNode&>(node).value;
+        case Kind::Variable: {
+            auto it = variables.find(static_cast<const VariableNode&>(node).name);
+            if (it != variables.end()) {
+                return it->second;
+            }
+            return std::nullopt;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(node);
+            auto leftVal = evaluateNode(*binary.left, variables);
+            auto rightVal = evaluateNode(*binary.right, variables);
+
+            if (!leftVal || !rightVal) {
+                return std::nullopt;
+            }
+
+            return applyBinary(binary.op, *leftVal, *rightVal);
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(node);
+            auto val = evaluateNode(*unary.operand, variables);
+            if (!val) {
+                return std::nullopt;
+            }
+
+            return applyUnary(unary.func, *val);
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(node);
+            size_t arity = function.arguments.size();
+            T small[4];
+            std::vector<T> large;
+            T* values = small;
+            if (arity > 4) {
+                large.resize(arity);
+                values = large.data();
+            }
+            for (size_t k = 0; k < arity; ++k) {
+                auto val = evaluateNode(*function.arguments[k], variables);
+                if (!val) {
+                    return std::nullopt;
+                }
+                values[k] = *val;
+            }
+            return function.definition->evaluate(values);
+        }
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(node);
+            auto val = evaluateNode(*polynomial.base, variables);
+            if (!val) {
+                return std::nullopt;
+            }
+            return evaluatePolynomial(polynomial, *val);
+        }
+    }
+    throw std::invalid_argument("неизвестный узел");
+}
+
+template<typename T>
+std::string Expression<T>::toStringNode(const Node& node, const std::map<std::string, T>* variables) {
+    switch (node.kind) {
+        case Kind::Constant:
+            return constantToString(static_cast<const ConstantNode&>(node).value);
+        case Kind::Variable: {
+            const auto& name = static_cast<const VariableNode&>(node).name;
+            if (variables) {
+                auto it = variables->find(name);
+                if (it != variables->end()) {
+                    std::ostringstream oss;
+                    oss << it->second;
+                    return oss.str();
+                }
+            }
+            return name;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(node);
+            std::string leftStr = toStringNode(*binary.left, variables);
+            std::string rightStr = toStringNode(*binary.right, variables);
+
+            if (precedence(*binary.left) < precedence(node)) {
+                leftStr = "(" + leftStr + ")";
+            }
+            bool nonAssociative = binary.op == '-' || binary.op == '/' || binary.op == '^';
+            if (precedence(*binary.right) < precedence(node) || (nonAssociative && precedence(*binary.right) == precedence(node))) {
+                rightStr = "(" + rightStr + ")";
+            }
+
+            return leftStr + " " + binary.op + " " + rightStr;
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(node);
+            std::string result = functionName(unary.func);
+            return result + "(" + toStringNode(*unary.operand, variables) + ")";
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(node);
+            std::string result = function.definition->name + "(";
+            for (size_t k = 0; k < function.arguments.size(); ++k) {
+                if (k > 0) {
+                    result += ", ";
+                }
+                result += toStringNode(*function.arguments[k], variables);
+            }
+            return result + ")";
+        }
+        case Kind::Polynomial:
+            return toStringNode(*expandPolynomial(static_cast<const PolynomialNode&>(node)), variables);
+    }
+    throw std::invalid_argument("неизвестный узел");
+}
+
+// Подстановка с мемоизацией сохраняет разделение узлов: общий DAG не разворачивается в дерево.
+// Запоминаются только узлы с несколькими владельцами, у остальных повторных посещений не бывает.
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::substituteNode(const NodePtr& node, const std::string& variable, T value, NodeMemo& memo) {
+    bool shared = node.use_count() > 1;
+    if (shared) {
+        auto cached = memo.find(node.get());
+        if (cached != memo.end()) {
+            return cached->second;
+        }
+    }
+    auto result = replaceNode(node, variable, value, memo);
+    if (shared) {
+        memo.emplace(node.get(), result);
+    }
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::replaceNode(const NodePtr& node, const std::string& variable, T value, NodeMemo& memo) {
+    switch (node->kind) {
+        case Kind::Constant:
+            return node;
+        case Kind::Variable:
+            if (static_cast<const VariableNode&>(*node).name == variable) {
+                return std::make_shared<ConstantNode>(value);
+            }
+            return node;
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+            auto newLeft = substituteNode(binary.left, variable, value, memo);
+            auto newRight = substituteNode(binary.right, variable, value, memo);
+            if (newLeft == binary.left && newRight == binary.right) {
+                return node;
+            }
+            return std::make_shared<BinaryOperationNode>(binary.op, std::move(newLeft), std::move(newRight));
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+            auto newOperand = substituteNode(unary.operand, variable, value, memo);
+            if (newOperand == unary.operand) {
+                return node;
+            }
+            return std::make_shared<UnaryOperationNode>(unary.func, std::move(newOperand));
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(*node);
+            std::vector<NodePtr> arguments;
+            bool changed = false;
+            for (const auto& argument : function.arguments) {
+                arguments.push_back(substituteNode(argument, variable, value, memo));
+                changed = changed || arguments.back() != argument;
+            }
+            if (!changed) {
+                return node;
+            }
+            return std::make_shared<FunctionNode>(function.id, function.definition, std::move(arguments));
+        }
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(*node);
+            auto newBase = substituteNode(polynomial.base, variable, value, memo);
+            if (newBase == polynomial.base) {
+                return node;
+            }
+            if (auto constant = asConstant(*newBase)) {
+                return std::make_shared<ConstantNode>(evaluatePolynomial(polynomial, constant->value));
+            }
+            return std::make_shared<PolynomialNode>(std::move(newBase), polynomial.terms);
+        }
+    }
+    throw std::invalid_argument("неизвестный узел");
+}
+
+template<typename T>
+int Expression<T>::precedence(const Node& node) {
+    switch (node.kind) {
+        case Kind::Constant:
+        case Kind::Variable:
+            return 0;
+        case Kind::BinaryOperation:
+            switch (static_cast<const BinaryOperationNode&>(node).op) {
+                case '^': return 4;
+                case '*': case '/': return 3;
+                case '+': case '-': return 2;
+                default: return 1;
+            }
+        case Kind::UnaryOperation:
+        case Kind::FunctionCall:
+            return 5;
+        case Kind::Polynomial:
+            return 2;
+    }
+    return 0;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::differentiateNode(const NodePtr& node, const std::string& variable, NodeMemo& memo) {
+    auto cached = memo.find(node.get());
+    if (cached != memo.end()) {
+        return cached->second;
+    }
+    auto result = deriveNode(node, variable, memo);
+    memo.emplace(node.get(), result);
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::deriveNode(const NodePtr& node, const std::string& variable, NodeMemo& memo) {
+    switch (node->kind) {
+        case Kind::Constant:
+            return std::make_shared<ConstantNode>(0);
+        case Kind::Variable:
+            if (static_cast<const VariableNode&>(*node).name == variable) {
+                return std::make_shared<ConstantNode>(1);
+            }
+            return std::make_shared<ConstantNode>(0);
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+            const NodePtr& left = binary.left;
+            const NodePtr& right = binary.right;
+            auto leftDiff = differentiateNode(left, variable, memo);
+            auto rightDiff = differentiateNode(right, variable, memo);
+
+            switch (binary.op) {
+                case '+': return std::make_shared<BinaryOperationNode>('+', std::move(leftDiff), std::move(rightDiff));
+                case '-': return std::make_shared<BinaryOperationNode>('-', std::move(leftDiff), std::move(rightDiff));
+                case '*': {
+                    auto leftRight = std::make_shared<BinaryOperationNode>('*', left, std::move(rightDiff));
+                    auto rightLeft = std::make_shared<BinaryOperationNode>('*', right, std::move(leftDiff));
+                    return std::make_shared<BinaryOperationNode>('+', std::move(leftRight), std::move(rightLeft));
+                }
+                case '/': {
+                    auto numerator1 = std::make_shared<BinaryOperationNode>('*', std::move(leftDiff), right);
+                    auto numerator2 = std::make_shared<BinaryOperationNode>('*', left, std::move(rightDiff));
+                    auto numerator = std::make_shared<BinaryOperationNode>('-', std::move(numerator1), std::move(numerator2));
+                    auto denominator = std::make_shared<BinaryOperationNode>('^', right, std::make_shared<ConstantNode>(2));
+                    return std::make_shared<BinaryOperationNode>('/', std::move(numerator), std::move(denominator));
+                }
+                case '^': {
+                    if (auto exponent = asConstant(*right)) {
+                        if (exponent->value == T(2)) {
+                            auto twice = std::make_shared<BinaryOperationNode>('*', std::make_shared<ConstantNode>(2), left);
+                            return std::make_shared<BinaryOperationNode>('*', std::move(twice), std::move(leftDiff));
+                        }
+                        auto power = std::make_shared<BinaryOperationNode>('^', left, std::make_shared<ConstantNode>(exponent->value - T(1)));
+                        auto scaled = std::make_shared<BinaryOperationNode>('*', right, std::move(power));
+                        return std::make_shared<BinaryOperationNode>('*', std::move(scaled), std::move(leftDiff));
+                    }
+                    auto logTerm = std::make_shared<BinaryOperationNode>('*', std::move(rightDiff), std::make_shared<UnaryOperationNode>(Function::Ln, left));
+                    auto ratio = std::make_shared<BinaryOperationNode>('/', std::move(leftDiff), left);
+                    auto ratioTerm = std::make_shared<BinaryOperationNode>('*', right, std::move(ratio));
+                    auto factor = std::make_shared<BinaryOperationNode>('+', std::move(logTerm), std::move(ratioTerm));
+                    return std::make_shared<BinaryOperationNode>('*', node, std::move(factor));
+                }
+                default: throw std::invalid_argument("неизвестный оператор");
+            }
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+            const NodePtr& operand = unary.operand;
+            auto operandDiff = differentiateNode(operand, variable, memo);
+
+            switch (unary.func) {
+                case Function::Negate:
+                    return std::make_shared<UnaryOperationNode>(Function::Negate, std::move(operandDiff));
+                case Function::Sin: {
+                    auto cosNode = std::make_shared<UnaryOperationNode>(Function::Cos, operand);
+                    return std::make_shared<BinaryOperationNode>('*', std::move(cosNode), std::move(operandDiff));
+                }
+                case Function::Cos: {
+                    auto sinNode = std::make_shared<UnaryOperationNode>(Function::Sin, operand);
+                    auto negSinNode = std::make_shared<UnaryOperationNode>(Function::Negate, std::move(sinNode));
+                    return std::make_shared<BinaryOperationNode>('*', std::move(negSinNode), std::move(operandDiff));
+                }
+                case Function::Ln:
+                    return std::make_shared<BinaryOperationNode>('/', std::move(operandDiff), operand);
+                case Function::Exp: {
+                    auto expNode = std::make_shared<UnaryOperationNode>(Function::Exp, operand);
+                    return std::make_shared<BinaryOperationNode>('*', std::move(expNode), std::move(operandDiff));
+                }
+            }
+            throw std::invalid_argument("неизвестная функция");
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(*node);
+            if (!function.definition->partialDerivative) {
+                throw std::invalid_argument("нет правила дифференцирования для функции " + function.definition->name);
+            }
+            std::vector<Expression> arguments;
+            for (const auto& argument : function.arguments) {
+                arguments.push_back(Expression(argument));
+            }
+            NodePtr result;
+            for (size_t k = 0; k < arguments.size(); ++k) {
+                auto argumentDiff = differentiateNode(function.arguments[k], variable, memo);
+                auto constant = asConstant(*argumentDiff);
+                if (constant && constant->value == T(0)) {
+                    continue;
+                }
+                auto partial = function.definition->partialDerivative(arguments, k);
+                auto term = std::make_shared<BinaryOperationNode>('*', std::move(partial.root), std::move(argumentDiff));
+                if (result) {
+                    result = std::make_shared<BinaryOperationNode>('+', std::move(result), std::move(term));
+                } else {
+                    result = std::move(term);
+                }
+            }
+            if (!result) {
+                return std::make_shared<ConstantNode>(0);
+            }
+            return result;
+        }
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(*node);
+            auto baseDiff = differentiateNode(polynomial.base, variable, memo);
+            auto constant = asConstant(*baseDiff);
+            if (constant && constant->value == T(0)) {
+                return std::make_shared<ConstantNode>(0);
+            }
+            std::vector<std::pair<unsigned, T>> terms;
+            for (const auto& [exponent, coefficient] : polynomial.terms) {
+                if (exponent > 0) {
+                    terms.emplace_back(exponent - 1, coefficient * T(exponent));
+                }
+            }
+            auto derivative = makePolynomial(polynomial.base, std::move(terms));
+            if (constant && constant->value == T(1)) {
+                return derivative;
+            }
+            return std::make_shared<BinaryOperationNode>('*', std::move(derivative), std::move(baseDiff));
+        }
+    }
+    throw std::invalid_argument("неизвестный узел");
+}
+
+// Статистика поддерева по дереву складывается из статистик детей, поэтому каждый узел DAG
+// обходится один раз, сколько бы раз он ни входил в развёрнутое дерево.
+template<typename T>
+const typename Expression<T>::Statistics& Expression<T>::collectNode(const Node& node, StatisticsMemo& memo) {
+    auto cached = memo.find(&node);
+    if (cached != memo.end()) {
+        return cached->second;
+    }
+    Statistics stats;
+    auto add = [&stats](const Statistics& child) {
+        stats.constants = Statistics::saturatingAdd(stats.constants, child.constants);
+        stats.variables = Statistics::saturatingAdd(stats.variables, child.variables);
+        stats.binaryOperations = Statistics::saturatingAdd(stats.binaryOperations, child.binaryOperations);
+        stats.unaryOperations = Statistics::saturatingAdd(stats.unaryOperations, child.unaryOperations);
+        stats.functionCalls = Statistics::saturatingAdd(stats.functionCalls, child.functionCalls);
+        stats.polynomials = Statistics::saturatingAdd(stats.polynomials, child.polynomials);
+        stats.depth = std::max(stats.depth, child.depth);
+    };
+    switch (node.kind) {
+        case Kind::Constant:
+            stats.constants = 1;
+            break;
+        case Kind::Variable:
+            stats.variables = 1;
+            break;
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(node);
+            add(collectNode(*binary.left, memo));
+            add(collectNode(*binary.right, memo));
+            stats.binaryOperations = Statistics::saturatingAdd(stats.binaryOperations, 1);
+            break;
+        }
+        case Kind::UnaryOperation:
+            add(collectNode(*static_cast<const UnaryOperationNode&>(node).operand, memo));
+            stats.unaryOperations = Statistics::saturatingAdd(stats.unaryOperations, 1);
+            break;
+        case Kind::FunctionCall:
+            for (const auto& argument : static_cast<const FunctionNode&>(node).arguments) {
+                add(collectNode(*argument, memo));
+            }
+            stats.functionCalls = Statistics::saturatingAdd(stats.functionCalls, 1);
+            break;
+        case Kind::Polynomial:
+            add(collectNode(*static_cast<const PolynomialNode&>(node).base, memo));
+            stats.polynomials = Statistics::saturatingAdd(stats.polynomials, 1);
+            break;
+    }
+    stats.depth++;
+    return memo.emplace(&node, stats).first->second;
+}
+
+template<typename T>
+const char* Expression<T>::functionName(Function func) {
+    switch (func) {
+        case Function::Negate: return "-";
+        case Function::Sin: return "sin";
+        case Function::Cos: return "cos";
+        case Function::Ln: return "ln";
+        case Function::Exp: return "exp";
+    }
+    return "?";
+}
+
+template<typename T>
+std::optional<typename Expression<T>::Function> Expression<T>::functionFromName(const std::string& name) {
+    if (name == "sin") return Function::Sin;
+    if (name == "cos") return Function::Cos;
+    if (name == "ln") return Function::Ln;
+    if (name == "exp") return Function::Exp;
+    return std::nullopt;
+}
+
+template<typename T>
+Expression<T> Expression<T>::simplify() const {
+    EXPRESSION_PROFILE_PHASE(simplifyNanoseconds);
+    NodeMemo memo;
+    auto simplifiedRoot = simplifyNode(root, memo);
+    return Expression(std::move(simplifiedRoot));
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::simplifyNode(const NodePtr& node, NodeMemo& memo) {
+    auto cached = memo.find(node.get());
+    if (cached != memo.end()) {
+        return cached->second;
+    }
+    auto result = reduceNode(node, memo);
+    memo.emplace(node.get(), result);
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::reduceNode(const NodePtr& node, NodeMemo& memo) {
+    switch (node->kind) {
+        case Kind::BinaryOperation: {
+            auto binaryNode = static_cast<const BinaryOperationNode*>(node.get());
+            auto left = simplifyNode(binaryNode->left, memo);
+            auto right = simplifyNode(binaryNode->right, memo);
+            auto leftConstant = asConstant(*left);
+            auto rightConstant = asConstant(*right);
+
+            if (binaryNode->op == '*') {
+                if ((leftConstant && leftConstant->value == T(0)) || (rightConstant && rightConstant->value == T(0))) {
+                    return std::make_shared<ConstantNode>(0);
+                }
+                if (leftConstant && leftConstant->value == T(1)) {
+                    return right;
+                }
+                if (rightConstant && rightConstant->value == T(1)) {
+                    return left;
+                }
+                if (leftConstant && rightConstant) {
+                    return std::make_shared<ConstantNode>(leftConstant->value * rightConstant->value);
+                }
+            }
+
+            if (binaryNode->op == '+') {
+                if (leftConstant && leftConstant->value == T(0)) {
+                    return right;
+                }
+                if (rightConstant && rightConstant->value == T(0)) {
+                    return left;
+                }
+            }
+
+            if (left == binaryNode->left && right == binaryNode->right) {
+                return node;
+            }
+            return std::make_shared<BinaryOperationNode>(binaryNode->op, std::move(left), std::move(right));
+        }
+        case Kind::UnaryOperation: {
+            auto unaryNode = static_cast<const UnaryOperationNode*>(node.get());
+            auto operand = simplifyNode(unaryNode->operand, memo);
+            if (operand == unaryNode->operand) {
+                return node;
+            }
+            return std::make_shared<UnaryOperationNode>(unaryNode->func, std::move(operand));
+        }
+        case Kind::FunctionCall: {
+            auto functionNode = static_cast<const FunctionNode*>(node.get());
+            std::vector<NodePtr> arguments;
+            bool changed = false;
+            for (const auto& argument : functionNode->arguments) {
+                arguments.push_back(simplifyNode(argument, memo));
+                changed = changed || arguments.back() != argument;
+            }
+            if (!changed) {
+                return node;
+            }
+            return std::make_shared<FunctionNode>(functionNode->id, functionNode->definition, std::move(arguments));
+        }
+        case Kind::Polynomial: {
+            auto polynomialNode = static_cast<const PolynomialNode*>(node.get());
+            auto base = simplifyNode(polynomialNode->base, memo);
+            if (base == polynomialNode->base) {
+                return node;
+            }
+            if (auto constant = asConstant(*base)) {
+                return std::make_shared<ConstantNode>(evaluatePolynomial(*polynomialNode, constant->value));
+            }
+            return std::make_shared<PolynomialNode>(std::move(base), polynomialNode->terms);
+        }
+        default:
+            return node;
+    }
+}
+
+template<typename T>
+Expression<T> Expression<T>::toPolynomialForm() const {
+    PolynomialMemo polynomials;
+    NodeMemo memo;
+    return Expression(polynomialNode(root, polynomials, memo));
+}
+
+template<typename T>
+std::optional<std::vector<T>> Expression<T>::polynomialCoefficients(const std::string& variable) const {
+    PolynomialMemo polynomials;
+    const auto& polynomial = extractPolynomial(root, polynomials);
+    if (!polynomial || (!polynomial->variable.empty() && polynomial->variable != variable)) {
+        return std::nullopt;
+    }
+    unsigned degree = polynomial->coefficients.empty() ? 0 : polynomial->coefficients.rbegin()->first;
+    std::vector<T> result(degree + 1, T(0));
+    for (const auto& [exponent, coefficient] : polynomial->coefficients) {
+        result[exponent] = coefficient;
+    }
+    return result;
+}
+
+template<typename T>
+std::optional<std::vector<T>> Expression<T>::taylorCoefficients(const std::string& variable, T point, unsigned order,
+                                                                const std::map<std::string, T>& parameters) const {
+    size_t length = size_t(order) + 1;
+    TaylorContext context{variable, point, parameters, {}, {}};
+    auto series = taylorNode(root, length, context);
+    if (!series) {
+        return std::nullopt;
+    }
+    return std::vector<T>(series->begin(), series->begin() + length);
+}
+
+template<typename T>
+std::optional<Expression<T>> Expression<T>::taylorPolynomial(const std::string& variable, T point, unsigned order,
+                                                             const std::map<std::string, T>& parameters) const {
+    auto coefficients = taylorCoefficients(variable, point, order, parameters);
+    if (!coefficients) {
+        return std::nullopt;
+    }
+    NodePtr base = std::make_shared<VariableNode>(variable);
+    if (point != T(0)) {
+        base = std::make_shared<BinaryOperationNode>('-', std::move(base), std::make_shared<ConstantNode>(point));
+    }
+    std::vector<std::pair<unsigned, T>> terms;
+    for (size_t k = coefficients->size(); k-- > 0;) {
+        if ((*coefficients)[k] != T(0)) {
+            terms.emplace_back(static_cast<unsigned>(k), (*coefficients)[k]);
+        }
+    }
+    return Expression(makePolynomial(std::move(base), std::move(terms)));
+}
+
+// Ряд узла хранится в memo по указателю; префикс ряда не зависит от длины усечения,
+// поэтому более длинная запись отвечает и на более короткий запрос.
+template<typename T>
+const typename Expression<T>::Series* Expression<T>::taylorNode(const NodePtr& node, size_t length, TaylorContext& context) {
+    auto cached = context.memo.find(node.get());
+    if (cached != context.memo.end() && cached->second.size() >= length) {
+        return &cached->second;
+    }
+    Series result;
+    if (!expandTaylor(node, length, context, result)) {
+        return nullptr;
+    }
+    auto& entry = context.memo[node.get()];
+    entry = std::move(result);
+    return &entry;
+}
+
+template<typename T>
+bool Expression<T>::expandTaylor(const NodePtr& node, size_t length, TaylorContext& context, Series& result) {
+    switch (node->kind) {
+        case Kind::Constant:
+            result.assign(length, T(0));
+            result[0] = static_cast<const ConstantNode&>(*node).value;
+            return true;
+        case Kind::Variable: {
+            const auto& name = static_cast<const VariableNode&>(*node).name;
+            result.assign(length, T(0));
+            if (name == context.variable) {
+                result[0] = context.point;
+                if (length > 1) {
+                    result[1] = T(1);
+                }
+                return true;
+            }
+            auto it = context.parameters.find(name);
+            if (it == context.parameters.end()) {
+                return false;
+            }
+            result[0] = it->second;
+            return true;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+            auto left = taylorNode(binary.left, length, context);
+            auto right = taylorNode(binary.right, length, context);
+            if (!left || !right) {
+                return false;
+            }
+            switch (binary.op) {
+                case '+':
+                case '-':
+                    result.resize(length);
+                    for (size_t k = 0; k < length; ++k) {
+                        result[k] = binary.op == '+' ? (*left)[k] + (*right)[k] : (*left)[k] - (*right)[k];
+                    }
+                    return true;
+                case '*':
+                    result = seriesProduct(*left, *right, length);
+                    return true;
+                case '/':
+                    result = seriesQuotient(*left, *right, length);
+                    return true;
+                case '^': {
+                    bool constantExponent = std::all_of(right->begin() + 1, right->begin() + length, [](const T& c) { return c == T(0); });
+                    if (constantExponent) {
+                        result = seriesPower(*left, (*right)[0], length);
+                    } else {
+                        result = seriesExp(seriesProduct(*right, seriesLn(*left, length), length), length);
+                    }
+                    return true;
+                }
+                default: throw std::invalid_argument("неизвестный оператор");
+            }
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+            auto operand = taylorNode(unary.operand, length, context);
+            if (!operand) {
+                return false;
+            }
+            switch (unary.func) {
+                case Function::Negate:
+                    result.resize(length);
+                    for (size_t k = 0; k < length; ++k) {
+                        result[k] = -(*operand)[k];
+                    }
+                    return true;
+                case Function::Sin: {
+                    Series cosine;
+                    seriesSinCos(*operand, length, result, cosine);
+                    return true;
+                }
+                case Function::Cos: {
+                    Series sine;
+                    seriesSinCos(*operand, length, sine, result);
+                    return true;
+                }
+                case Function::Ln:
+                    result = seriesLn(*operand, length);
+                    return true;
+                case Function::Exp:
+                    result = seriesExp(*operand, length);
+                    return true;
+            }
+            throw std::invalid_argument("неизвестная функция");
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(*node);
+            // Встроенные sqrt и tan раскладываются своими рекуррентными формулами, без
+            // построения частных производных.
+            const auto& name = function.definition->name;
+            if (name == "sqrt" || name == "tan") {
+                auto argument = taylorNode(function.arguments[0], length, context);
+                if (!argument) {
+                    return false;
+                }
+                if (name == "sqrt") {
+                    result = seriesSqrt(*argument, length);
+                } else {
+                    Series sine, cosine;
+                    seriesSinCos(*argument, length, sine, cosine);
+                    result = seriesQuotient(sine, cosine, length);
+                }
+                return true;
+            }
+            size_t arity = function.arguments.size();
+            std::vector<const Series*> arguments(arity);
+            std::vector<T> values(arity);
+            for (size_t k = 0; k < arity; ++k) {
+                arguments[k] = taylorNode(function.arguments[k], length, context);
+                if (!arguments[k]) {
+                    return false;
+                }
+                values[k] = (*arguments[k])[0];
+            }
+            result.assign(length, T(0));
+            result[0] = function.definition->evaluate(values.data());
+            if (length == 1) {
+                return true;
+            }
+            // f(u)' = sum df/du_k * u_k': частные производные раскладываются на порядок короче,
+            // а ряд f получается почленным интегрированием.
+            std::vector<Expression> symbolic;
+            Series derivative(length - 1, T(0));
+            for (size_t k = 0; k < arity; ++k) {
+                const Series& argument = *arguments[k];
+                Series argumentDiff(length - 1);
+                bool constant = true;
+                for (size_t m = 1; m < length; ++m) {
+                    argumentDiff[m - 1] = T(m) * argument[m];
+                    constant = constant && argument[m] == T(0);
+                }
+                if (constant) {
+                    continue;
+                }
+                if (!function.definition->partialDerivative) {
+                    throw std::invalid_argument("нет правила дифференцирования для функции " + function.definition->name);
+                }
+                NodePtr& cachedRoot = context.partials[{node.get(), k}];
+                if (!cachedRoot) {
+                    if (symbolic.empty()) {
+                        for (const auto& argument : function.arguments) {
+                            symbolic.push_back(Expression(argument));
+                        }
+                    }
+                    cachedRoot = function.definition->partialDerivative(symbolic, k).root;
+                }
+                NodePtr derivativeRoot = cachedRoot;
+                auto partial = taylorNode(derivativeRoot, length - 1, context);
+                if (!partial) {
+                    return false;
+                }
+                auto term = seriesProduct(*partial, argumentDiff, length - 1);
+                for (size_t m = 0; m + 1 < length; ++m) {
+                    derivative[m] += term[m];
+                }
+            }
+            for (size_t m = 1; m < length; ++m) {
+                result[m] = derivative[m - 1] / T(m);
+            }
+            return true;
+        }
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(*node);
+            auto base = taylorNode(polynomial.base, length, context);
+            if (!base) {
+                return false;
+            }
+            const auto& terms = polynomial.terms;
+            result.assign(length, T(0));
+            result[0] = terms.front().second;
+            for (size_t k = 1; k < terms.size(); ++k) {
+                unsigned gap = terms[k - 1].first - terms[k].first;
+                result = seriesProduct(result, gap == 1 ? *base : seriesIntegerPower(*base, gap, length), length);
+                result[0] += terms[k].second;
+            }
+            unsigned lowest = terms.back().first;
+            if (lowest > 0) {
+                result = seriesProduct(result, seriesIntegerPower(*base, lowest, length), length);
+            }
+            return true;
+        }
+    }
+    throw std::invalid_argument("неизвестный узел");
+}
+
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesProduct(const Series& left, const Series& right, size_t length) {
+    Series result(length);
+    for (size_t k = 0; k < length; ++k) {
+        T sum(0);
+        for (size_t j = 0; j <= k; ++j) {
+            sum += left[j] * right[k - j];
+        }
+        result[k] = sum;
+    }
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesQuotient(const Series& left, const Series& right, size_t length) {
+    Series result(length);
+    for (size_t k = 0; k < length; ++k) {
+        T sum = left[k];
+        for (size_t j = 1; j <= k; ++j) {
+            sum -= right[j] * result[k - j];
+        }
+        result[k] = sum / right[0];
+    }
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesIntegerPower(Series base, unsigned exponent, size_t length) {
+    base.resize(length);
+    Series result(length, T(0));
+    result[0] = T(1);
+    while (exponent > 0) {
+        if (exponent & 1u) {
+            result = seriesProduct(result, base, length);
+        }
+        exponent >>= 1;
+        if (exponent > 0) {
+            base = seriesProduct(base, base, length);
+        }
+    }
+    return result;
+}
+
+// Целые показатели, как и в power, возводятся повторным возведением в квадрат: так ряд
+// остаётся точным и при нулевом значении основания. Иначе из a * c' = p * a' * c.
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesPower(const Series& base, T exponent, size_t length) {
+    auto real = std::real(exponent);
+    if (std::imag(exponent) == 0 && real == std::trunc(real) && std::fabs(real) <= 64) {
+        auto result = seriesIntegerPower(base, static_cast<unsigned>(std::fabs(real)), length);
+        if (real < 0) {
+            Series one(length, T(0));
+            one[0] = T(1);
+            return seriesQuotient(one, result, length);
+        }
+        return result;
+    }
+    Series result(length);
+    result[0] = power(base[0], exponent);
+    for (size_t k = 1; k < length; ++k) {
+        T sum(0);
+        for (size_t j = 1; j <= k; ++j) {
+            sum += (exponent * T(j) - T(k - j)) * base[j] * result[k - j];
+        }
+        result[k] = sum / (T(k) * base[0]);
+    }
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesExp(const Series& operand, size_t length) {
+    Series result(length);
+    result[0] = std::exp(operand[0]);
+    for (size_t k = 1; k < length; ++k) {
+        T sum(0);
+        for (size_t j = 1; j <= k; ++j) {
+            sum += T(j) * operand[j] * result[k - j];
+        }
+        result[k] = sum / T(k);
+    }
+    return result;
+}
+
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesLn(const Series& operand, size_t length) {
+    Series result(length);
+    result[0] = std::log(operand[0]);
+    for (size_t k = 1; k < length; ++k) {
+        T sum = T(k) * operand[k];
+        for (size_t j = 1; j < k; ++j) {
+            sum -= T(k - j) * operand[j] * result[k - j];
+        }
+        result[k] = sum / (T(k) * operand[0]);
+    }
+    return result;
+}
+
+// Из c * c = a: c[k] = (a[k] - sum c[j] * c[k - j], 0 < j < k) / (2 * c[0]).
+template<typename T>
+typename Expression<T>::Series Expression<T>::seriesSqrt(const Series& operand, size_t length) {
+    Series result(length);
+    result[0] = std::sqrt(operand[0]);
+    for (size_t k = 1; k < length; ++k) {
+        T sum = operand[k];
+        for (size_t j = 1; j < k; ++j) {
+            sum -= result[j] * result[k - j];
+        }
+        result[k] = sum / (T(2) * result[0]);
+    }
+    return result;
+}
+
+template<typename T>
+void Expression<T>::seriesSinCos(const Series& operand, size_t length, Series& sine, Series& cosine) {
+    sine.assign(length, T(0));
+    cosine.assign(length, T(0));
+    sine[0] = std::sin(operand[0]);
+    cosine[0] = std::cos(operand[0]);
+    for (size_t k = 1; k < length; ++k) {
+        T sineSum(0);
+        T cosineSum(0);
+        for (size_t j = 1; j <= k; ++j) {
+            T scaled = T(j) * operand[j];
+            sineSum += scaled * cosine[k - j];
+            cosineSum -= scaled * sine[k - j];
+        }
+        sine[k] = sineSum / T(k);
+        cosine[k] = cosineSum / T(k);
+    }
+}
+
+template<typename T>
+const std::optional<typename Expression<T>::PolynomialTerms>& Expression<T>::extractPolynomial(const NodePtr& node, PolynomialMemo& polynomials) {
+    auto cached = polynomials.find(node.get());
+    if (cached != polynomials.end()) {
+        return cached->second;
+    }
+    auto result = combinePolynomials(*node, polynomials);
+    if (result && (result->coefficients.empty() || result->coefficients.rbegin()->first == 0)) {
+        result->variable.clear();
+    }
+    return polynomials.emplace(node.get(), std::move(result)).first->second;
+}
+
+template<typename T>
+std::optional<typename Expression<T>::PolynomialTerms> Expression<T>::combinePolynomials(const Node& node, PolynomialMemo& polynomials) {
+    using Coefficients = std::map<unsigned, T>;
+    auto degree = [](const PolynomialTerms& polynomial) {
+        return polynomial.coefficients.empty() ? 0u : polynomial.coefficients.rbegin()->first;
+    };
+    auto accumulate = [](Coefficients& coefficients, unsigned exponent, const T& value) {
+        T& slot = coefficients[exponent];
+        slot += value;
+        if (slot == T(0)) {
+            coefficients.erase(exponent);
+        }
+    };
+    auto multiply = [&](const Coefficients& left, const Coefficients& right) {
+        Coefficients product;
+        for (const auto& [leftExponent, leftCoefficient] : left) {
+            for (const auto& [rightExponent, rightCoefficient] : right) {
+                accumulate(product, leftExponent + rightExponent, leftCoefficient * rightCoefficient);
+            }
+        }
+        return product;
+    };
+
+    PolynomialTerms result;
+    switch (node.kind) {
+        case Kind::Constant: {
+            T value = static_cast<const ConstantNode&>(node).value;
+            if (value != T(0)) {
+                result.coefficients[0] = value;
+            }
+            return result;
+        }
+        case Kind::Variable:
+            result.variable = static_cast<const VariableNode&>(node).name;
+            result.coefficients[1] = T(1);
+            return result;
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(node);
+            if (polynomial.base->kind != Kind::Variable) {
+                return std::nullopt;
+            }
+            result.variable = static_cast<const VariableNode&>(*polynomial.base).name;
+            result.coefficients.insert(polynomial.terms.begin(), polynomial.terms.end());
+            return result;
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(node);
+            if (unary.func != Function::Negate) {
+                return std::nullopt;
+            }
+            const auto& operand = extractPolynomial(unary.operand, polynomials);
+            if (!operand) {
+                return std::nullopt;
+            }
+            result = *operand;
+            for (auto& [exponent, coefficient] : result.coefficients) {
+                coefficient = -coefficient;
+            }
+            return result;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(node);
+            const auto& left = extractPolynomial(binary.left, polynomials);
+            const auto& right = extractPolynomial(binary.right, polynomials);
+            if (!left || !right) {
+                return std::nullopt;
+            }
+            if (!left->variable.empty() && !right->variable.empty() && left->variable != right->variable) {
+                return std::nullopt;
+            }
+            result.variable = left->variable.empty() ? right->variable : left->variable;
+            result.expandedPower = left->expandedPower || right->expandedPower;
+            switch (binary.op) {
+                case '+':
+                case '-':
+                    result.coefficients = left->coefficients;
+                    for (const auto& [exponent, coefficient] : right->coefficients) {
+                        accumulate(result.coefficients, exponent, binary.op == '+' ? coefficient : -coefficient);
+                    }
+                    return result;
+                case '*':
+                    if (degree(*left) + degree(*right) > maxPolynomialDegree) {
+                        return std::nullopt;
+                    }
+                    result.coefficients = multiply(left->coefficients, right->coefficients);
+                    return result;
+                case '/':
+                    if (degree(*right) > 0 || right->coefficients.empty()) {
+                        return std::nullopt;
+                    }
+                    for (const auto& [exponent, coefficient] : left->coefficients) {
+                        accumulate(result.coefficients, exponent, coefficient / right->coefficients.begin()->second);
+                    }
+                    return result;
+                case '^': {
+                    if (degree(*right) > 0) {
+                        return std::nullopt;
+                    }
+                    T exponent = right->coefficients.empty() ? T(0) : right->coefficients.begin()->second;
+                    auto real = std::real(exponent);
+                    if (std::imag(exponent) != 0 || real < 0 || real != std::trunc(real) ||
+                        real * std::max(degree(*left), 1u) > maxPolynomialDegree) {
+                        return std::nullopt;
+                    }
+                    auto count = static_cast<unsigned>(real);
+                    result.expandedPower = result.expandedPower || (count > 1 && left->coefficients.size() > 1);
+                    Coefficients base = left->coefficients;
+                    result.coefficients[0] = T(1);
+                    while (count > 0) {
+                        if (count & 1u) {
+                            result.coefficients = multiply(result.coefficients, base);
+                        }
+                        count >>= 1;
+                        if (count > 0) {
+                            base = multiply(base, base);
+                        }
+                    }
+                    return result;
+                }
+                default:
+                    return std::nullopt;
+            }
+        }
+        case Kind::FunctionCall:
+            return std::nullopt;
+    }
+    return std::nullopt;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::makePolynomial(NodePtr base, std::vector<std::pair<unsigned, T>> terms) {
+    if (terms.empty()) {
+        return std::make_shared<ConstantNode>(0);
+    }
+    if (terms.front().first == 0) {
+        return std::make_shared<ConstantNode>(terms.front().second);
+    }
+    if (terms.size() == 1 && terms.front().first == 1 && terms.front().second == T(1)) {
+        return base;
+    }
+    return std::make_shared<PolynomialNode>(std::move(base), std::move(terms));
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::polynomialNode(const NodePtr& node, PolynomialMemo& polynomials, NodeMemo& memo) {
+    auto cached = memo.find(node.get());
+    if (cached != memo.end()) {
+        return cached->second;
+    }
+
+    NodePtr result = node;
+    const auto& polynomial = extractPolynomial(node, polynomials);
+    bool foldable = node->kind == Kind::BinaryOperation || node->kind == Kind::UnaryOperation;
+    if (polynomial && foldable && !polynomial->expandedPower) {
+        NodePtr base;
+        if (!polynomial->variable.empty()) {
+            base = std::make_shared<VariableNode>(polynomial->variable);
+        }
+        result = makePolynomial(std::move(base), {polynomial->coefficients.rbegin(), polynomial->coefficients.rend()});
+    } else if (polynomial && node->kind == Kind::BinaryOperation && static_cast<const BinaryOperationNode&>(*node).op == '^') {
+        // Степень остаётся одночленом над свёрнутым основанием: (x - 1) ^ 20 -> {20: 1} над x - 1.
+        const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+        const auto& exponent = extractPolynomial(binary.right, polynomials)->coefficients;
+        auto count = exponent.empty() ? 0u : static_cast<unsigned>(std::real(exponent.begin()->second));
+        result = makePolynomial(polynomialNode(binary.left, polynomials, memo), {{count, T(1)}});
+    } else {
+        switch (node->kind) {
+            case Kind::BinaryOperation: {
+                const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+                auto left = polynomialNode(binary.left, polynomials, memo);
+                auto right = polynomialNode(binary.right, polynomials, memo);
+                if (left != binary.left || right != binary.right) {
+                    result = std::make_shared<BinaryOperationNode>(binary.op, std::move(left), std::move(right));
+                }
+                break;
+            }
+            case Kind::UnaryOperation: {
+                const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+                auto operand = polynomialNode(unary.operand, polynomials, memo);
+                if (operand != unary.operand) {
+                    result = std::make_shared<UnaryOperationNode>(unary.func, std::move(operand));
+                }
+                break;
+            }
+            case Kind::FunctionCall: {
+                const auto& function = static_cast<const FunctionNode&>(*node);
+                std::vector<NodePtr> arguments;
+                bool changed = false;
+                for (const auto& argument : function.arguments) {
+                    arguments.push_back(polynomialNode(argument, polynomials, memo));
+                    changed = changed || arguments.back() != argument;
+                }
+                if (changed) {
+                    result = std::make_shared<FunctionNode>(function.id, function.definition, std::move(arguments));
+                }
+                break;
+            }
+            case Kind::Polynomial: {
+                const auto& existing = static_cast<const PolynomialNode&>(*node);
+                auto base = polynomialNode(existing.base, polynomials, memo);
+                if (base != existing.base) {
+                    result = std::make_shared<PolynomialNode>(std::move(base), existing.terms);
+                }
+                break;
+            }
+            case Kind::Constant:
+            case Kind::Variable:
+                break;
+        }
+    }
+    memo.emplace(node.get(), result);
+    return result;
+}
+
+// Развёрнутая запись c * base ^ k + ... для вывода; разбирается fromString обратно.
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::expandPolynomial(const PolynomialNode& polynomial) {
+    NodePtr result;
+    for (const auto& [exponent, coefficient] : polynomial.terms) {
+        T magnitude = coefficient;
+        char op = '+';
+        if constexpr (!IsComplex<T>::value) {
+            if (result && coefficient < 0) {
+                magnitude = -coefficient;
+                op = '-';
+            }
+        }
+        NodePtr monomial;
+        if (exponent == 1) {
+            monomial = polynomial.base;
+        } else if (exponent > 1) {
+            monomial = std::make_shared<BinaryOperationNode>('^', polynomial.base, std::make_shared<ConstantNode>(T(exponent)));
+        }
+        NodePtr term;
+        if (!monomial) {
+            term = std::make_shared<ConstantNode>(magnitude);
+        } else if (magnitude == T(1)) {
+            term = std::move(monomial);
+        } else {
+            term = std::make_shared<BinaryOperationNode>('*', std::make_shared<ConstantNode>(magnitude), std::move(monomial));
+        }
+        result = result ? std::make_shared<BinaryOperationNode>(op, std::move(result), std::move(term)) : std::move(term);
+    }
+    return result;
+}
+
+template<typename T>
+void Expression<T>::skipWhitespace(const std::string& expr, size_t& pos) {
+    while (pos < expr.size() && std::isspace(expr[pos])) {
+        pos++;
+    }
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::parseExpression(const std::string& expr, size_t& pos) {
+    auto left = parseTerm(expr, pos);
+    skipWhitespace(expr, pos);
+
+    while (pos < expr.size()) {
+        char op = expr[pos];
+        if (op != '+' && op != '-') break;
+        pos++;
+        skipWhitespace(expr, pos);
+        auto right = parseTerm(expr, pos);
+        left = std::make_shared<BinaryOperationNode>(op, std::move(left), std::move(right));
+        skipWhitespace(expr, pos);
+    }
+    return left;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::parseTerm(const std::string& expr, size_t& pos) {
+    auto left = parseFactor(expr, pos);
+    skipWhitespace(expr, pos);
+
+    while (pos < expr.size()) {
+        char op = expr[pos];
+        if (op != '*' && op != '/') break;
+        pos++;
+        skipWhitespace(expr, pos);
+        auto right = parseFactor(expr, pos);
+        left = std::make_shared<BinaryOperationNode>(op, std::move(left), std::move(right));
+        skipWhitespace(expr, pos);
+    }
+    return left;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::parseFactor(const std::string& expr, size_t& pos) {
+    auto left = parseUnary(expr, pos);
+    skipWhitespace(expr, pos);
+
+    while (pos < expr.size() && expr[pos] == '^') {
+        pos++;
+        skipWhitespace(expr, pos);
+        auto right = parseUnary(expr, pos);
+        left = std::make_shared<BinaryOperationNode>('^', std::move(left), std::move(right));
+        skipWhitespace(expr, pos);
+    }
+    return left;
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::parseUnary(const std::string& expr, size_t& pos) {
+    skipWhitespace(expr, pos);
+
+    if (expr[pos] == '-') {
+        pos++;
+        skipWhitespace(expr, pos);
+        auto operand = parseUnary(expr, pos);
+        return std::make_shared<UnaryOperationNode>(Function::Negate, std::move(operand));
+    }
+
+    return parsePrimary(expr, pos);
+}
+
+template<typename T>
+typename Expression<T>::NodePtr Expression<T>::parsePrimary(const std::string& expr, size_t& pos) {
+    skipWhitespace(expr, pos);
+
+    if (expr[pos] == '-') {
+        pos++;
+        skipWhitespace(expr, pos);
+        auto operand = parsePrimary(expr, pos);
+        return std::make_shared<UnaryOperationNode>(Function::Negate, std::move(operand));
+    }
+
+    if (expr[pos] == '(') {
+        pos++;
+        skipWhitespace(expr, pos);
+
+        auto realPart = parseExpression(expr, pos);
+        skipWhitespace(expr, pos);
+
+        if (pos < expr.size() && (expr[pos] == '+' || expr[pos] == '-')) {
+            char sign = expr[pos];
+            pos++;
+            skipWhitespace(expr, pos);
+            auto imaginaryPart = parseExpression(expr, pos);
+            skipWhitespace(expr, pos);
+            if (pos >= expr.size() || expr[pos] != 'i') {
+                throw std::invalid_argument("ожидается 'i' в мнимой части");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+
+            if (expr[pos] != ')') {
+                throw std::invalid_argument("нужна вторая скобка");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            if (sign == '+') {
+                return std::make_shared<BinaryOperationNode>('+', std::move(realPart), std::move(imaginaryPart));
+            } else {
+                return std::make_shared<BinaryOperationNode>('-', std::move(realPart), std::move(imaginaryPart));
+            }
+        } else {
+            if (expr[pos] != ')') {
+                throw std::invalid_argument("нужна вторая скобка");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            return realPart;
+        }
+    }
+
+    if (std::isdigit(expr[pos]) || expr[pos] == '.') {
+        std::string numStr;
+        while (pos < expr.size() && (std::isdigit(expr[pos]) || expr[pos] == '.')) {
+            numStr += expr[pos++];
+        }
+        skipWhitespace(expr, pos);
+
+        T value = parseNumber<T>(numStr);
+
+        if (pos < expr.size() && (std::isalpha(expr[pos]) || expr[pos] == '(')) {
+            auto left = std::make_shared<ConstantNode>(value);
+            auto right = parsePrimary(expr, pos);
+            return std::make_shared<BinaryOperationNode>('*', std::move(left), std::move(right));
+        }
+
+        return std::make_shared<ConstantNode>(value);
+    }
+
+    if (std::isalpha(expr[pos])) {
+        std::string token;
+        while (pos < expr.size() && (std::isalnum(expr[pos]) || expr[pos] == '_')) {
+            token += expr[pos++];
+        }
+        skipWhitespace(expr, pos);
+
+        if (auto func = functionFromName(token)) {
+            if (expr[pos] != '(') {
+                throw std::invalid_argument("нужна первая скобка после функции");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            auto operand = parseExpression(expr, pos);
+            skipWhitespace(expr, pos);
+            if (expr[pos] != ')') {
+                throw std::invalid_argument("нужна вторая скобка после аргумента функции");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            return std::make_shared<UnaryOperationNode>(*func, std::move(operand));
+        }
+        int id;
+        if (auto definition = lookupFunction(token, id)) {
+            if (expr[pos] != '(') {
+                throw std::invalid_argument("нужна первая скобка после функции");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            std::vector<NodePtr> arguments;
+            arguments.push_back(parseExpression(expr, pos));
+            skipWhitespace(expr, pos);
+            while (pos < expr.size() && expr[pos] == ',') {
+                pos++;
+                skipWhitespace(expr, pos);
+                arguments.push_back(parseExpression(expr, pos));
+                skipWhitespace(expr, pos);
+            }
+            if (expr[pos] != ')') {
+                throw std::invalid_argument("нужна вторая скобка после аргумента функции");
+            }
+            pos++;
+            skipWhitespace(expr, pos);
+            if (arguments.size() != definition->arity) {
+                throw std::invalid_argument("неверное число аргументов функции " + token);
+            }
+            return std::make_shared<FunctionNode>(id, definition, std::move(arguments));
+        }
+        if (token == "i") {
+            if constexpr (IsComplex<T>::value) {
+                return std::make_shared<ConstantNode>(T(0, 1));
+            } else {
+                throw std::invalid_argument("мнимая единица поддерживается только для комплексных типов");
+            }
+        }
+
+        return std::make_shared<VariableNode>(token);
+    }
+
+    throw std::invalid_argument("неизвестный символ");
+}
+
+template<typename T>
+void printResult(const T& value) {
+    if constexpr (IsComplex<T>::value) {
+        if (value.imag() == 0) {
+            std::cout << value.real() << std::endl;
+        } else {
+            std::cout << "(" << value.real() << ", " << value.imag() << ")" << std::endl;
+        }
+    } else {
+        std::cout << value << std::endl;
+    }
+}
+
+template<typename T>
+std::string Expression<T>::constantToString(const T& value) {
+    if constexpr (IsComplex<T>::value) {
+        std::ostringstream oss;
+        if (value.imag() == 0) {
+            oss << value.real();
+        } else {
+            oss << "(" << value.real() << ", " << value.imag() << ")";
+        }
+        return oss.str();
+    } else {
+        return std::to_string(value);
+    }
+}
+
+namespace {
+
+template<typename V>
+void appendBytes(std::string& key, const V& value) {
+    key.append(reinterpret_cast<const char*>(&value), sizeof(V));
+}
+
+}
+
+template<typename T>
+ExpressionSet<T>::ExpressionSet(const std::vector<Expression<T>>& expressions) {
+    for (const auto& expr : expressions) {
+        add(expr);
+    }
+}
+
+template<typename T>
+size_t ExpressionSet<T>::add(const Expression<T>& expr) {
+    roots.push_back(expr.root);
+    outputs.push_back(compile(expr.root));
+    return outputs.size() - 1;
+}
+
+template<typename T>
+int ExpressionSet<T>::compile(const NodePtr& node) {
+    auto seen = visited.find(node.get());
+    if (seen != visited.end()) {
+        return seen->second;
+    }
+
+    Instruction instruction{node.get(), -1, -1};
+    std::vector<int> operands;
+    std::string key(1, static_cast<char>(node->kind));
+    switch (node->kind) {
+        case Kind::Constant: {
+            std::ostringstream oss;
+            oss << std::hexfloat << static_cast<const ConstantNode&>(*node).value;
+            key += oss.str();
+            break;
+        }
+        case Kind::Variable: {
+            const auto& name = static_cast<const VariableNode&>(*node).name;
+            auto [it, inserted] = variableIndices.emplace(name, static_cast<int>(names.size()));
+            if (inserted) {
+                names.push_back(name);
+            }
+            instruction.first = it->second;
+            key += name;
+            break;
+        }
+        case Kind::BinaryOperation: {
+            const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+            instruction.first = compile(binary.left);
+            instruction.second = compile(binary.right);
+            key += binary.op;
+            appendBytes(key, instruction.first);
+            appendBytes(key, instruction.second);
+            break;
+        }
+        case Kind::UnaryOperation: {
+            const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+            instruction.first = compile(unary.operand);
+            appendBytes(key, unary.func);
+            appendBytes(key, instruction.first);
+            break;
+        }
+        case Kind::FunctionCall: {
+            const auto& function = static_cast<const FunctionNode&>(*node);
+            appendBytes(key, function.id);
+            maxArity = std::max(maxArity, function.arguments.size());
+            for (const auto& argument : function.arguments) {
+                operands.push_back(compile(argument));
+                appendBytes(key, operands.back());
+            }
+            break;
+        }
+        case Kind::Polynomial: {
+            const auto& polynomial = static_cast<const PolynomialNode&>(*node);
+            instruction.first = compile(polynomial.base);
+            appendBytes(key, instruction.first);
+            std::ostringstream oss;
+            oss << std::hexfloat;
+            for (const auto& [exponent, coefficient] : polynomial.terms) {
+                oss << exponent << ':' << coefficient << ';';
+            }
+            key += oss.str();
+            break;
+        }
+    }
+
+    auto [it, inserted] = unique.emplace(key, static_cast<int>(instructions.size()));
+    if (inserted) {
+        if (node->kind == Kind::FunctionCall) {
+            instruction.first = static_cast<int>(functionOperands.size());
+            instruction.second = static_cast<int>(operands.size());
+            functionOperands.insert(functionOperands.end(), operands.begin(), operands.end());
+        }
+        instructions.push_back(instruction);
+    }
+    visited[node.get()] = it->second;
+    return it->second;
+}
+
+template<typename T>
+std::optional<std::vector<T>> ExpressionSet<T>::evaluate(const std::map<std::string, T>& variables) const {
+    std::vector<T> values(names.size());
+    for (size_t v = 0; v < names.size(); ++v) {
+        auto it = variables.find(names[v]);
+        if (it == variables.end()) {
+            return std::nullopt;
+        }
+        values[v] = it->second;
+    }
+
+    std::vector<T> slots(instructions.size());
+    std::vector<T> arguments;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        const auto& instruction = instructions[i];
+        switch (instruction.node->kind) {
+            case Kind::Constant:
+                slots[i] = static_cast<const ConstantNode*>(instruction.node)->value;
+                break;
+            case Kind::Variable:
+                slots[i] = values[instruction.first];
+                break;
+            case Kind::BinaryOperation:
+                slots[i] = Expression<T>::applyBinary(static_cast<const BinaryOperationNode*>(instruction.node)->op,
+                                                      slots[instruction.first], slots[instruction.second]);
+                break;
+            case Kind::UnaryOperation:
+                slots[i] = Expression<T>::applyUnary(static_cast<const UnaryOperationNode*>(instruction.node)->func,
+                                                     slots[instruction.first]);
+                break;
+            case Kind::FunctionCall: {
+                arguments.resize(instruction.second);
+                for (int k = 0; k < instruction.second; ++k) {
+                    arguments[k] = slots[functionOperands[instruction.first + k]];
+                }
+                slots[i] = static_cast<const FunctionNode*>(instruction.node)->definition->evaluate(arguments.data());
+                break;
+            }
+            case Kind::Polynomial:
+                slots[i] = Expression<T>::evaluatePolynomial(*static_cast<const PolynomialNode*>(instruction.node), slots[instruction.first]);
+                break;
+        }
+    }
+
+    std::vector<T> result;
+    result.reserve(outputs.size());
+    for (int output : outputs) {
+        result.push_back(slots[output]);
+    }
+    return result;
+}
+
+template<typename T>
+std::optional<std::vector<std::vector<T>>> ExpressionSet<T>::evaluateBatch(const std::map<std::string, std::vector<T>>& variables) const {
+    size_t count = variables.empty() ? 1 : variables.begin()->second.size();
+    for (const auto& [name, values] : variables) {
+        if (values.size() != count) {
+            throw std::invalid_argument("столбцы переменных разной длины");
+        }
+    }
+    std::vector<const T*> columns(names.size());
+    for (size_t v = 0; v < names.size(); ++v) {
+        auto it = variables.find(names[v]);
+        if (it == variables.end()) {
+            return std::nullopt;
+        }
+        columns[v] = it->second.data();
+    }
+
+    std::vector<std::vector<T>> result(outputs.size(), std::vector<T>(count));
+    std::vector<T*> results;
+    for (auto& column : result) {
+        results.push_back(column.data());
+    }
+    std::vector<T> buffer(instructions.size() * blockSize);
+    std::vector<const T*> arguments(maxArity);
+    std::vector<T> point(maxArity);
+    run(columns.data(), count, results.data(), buffer.data(), arguments.data(), point.data());
+    return result;
+}
+
+template<typename T>
+typename ExpressionSet<T>::Binding ExpressionSet<T>::bind(const std::vector<std::string>& columns) const {
+    Binding binding;
+    for (const auto& name : names) {
+        auto it = std::find(columns.begin(), columns.end(), name);
+        if (it == columns.end()) {
+            throw std::invalid_argument("не задана переменная: " + name);
+        }
+        binding.indices.push_back(static_cast<size_t>(it - columns.begin()));
+    }
+    binding.bound.resize(names.size());
+    binding.buffer.resize(instructions.size() * blockSize);
+    binding.arguments.resize(maxArity);
+    binding.point.resize(maxArity);
+    return binding;
+}
+
+template<typename T>
+uint32_t ExpressionSet<T>::evaluateBound(Binding& binding, const T* const* columns, size_t count, T* const* outputs) const noexcept {
+    if (binding.indices.size() != names.size() || binding.buffer.size() != instructions.size() * blockSize ||
+        binding.arguments.size() < maxArity || binding.point.size() < maxArity) {
+        return StaleBinding;
+    }
+    for (size_t v = 0; v < binding.indices.size(); ++v) {
+        binding.bound[v] = columns[binding.indices[v]];
+    }
+    return run(binding.bound.data(), count, outputs, binding.buffer.data(), binding.arguments.data(),
+               binding.point.data());
+}
+
+namespace {
+
+template<typename T>
+bool isNotANumber(const T& value) {
+    if constexpr (IsComplex<T>::value) {
+        return value.real() != value.real() || value.imag() != value.imag();
+    } else {
+        return value != value;
+    }
+}
+
+template<typename T>
+bool anyNotANumber(const T* values, size_t count) {
+    bool invalid = false;
+    for (size_t p = 0; p < count; ++p) {
+        invalid |= isNotANumber(values[p]);
+    }
+    return invalid;
+}
+
+template<typename T>
+bool outsideLogarithmDomain(const T& value) {
+    if constexpr (IsComplex<T>::value) {
+        return value == T(0);
+    } else {
+        return value <= T(0);
+    }
+}
+
+}
+
+// Ошибки собираются без ветвлений внутри циклов: флаги блока объединяются через |.
+// NaN проверяется там, где он возникает (функции и степени), потому что дальше его может
+// скрыть min или x ^ 0, и на выходах.
+template<typename T>
+uint32_t ExpressionSet<T>::run(const T* const* columns, size_t count, T* const* results, T* buffer, const T** arguments,
+                              T* point) const {
+    uint32_t errors = 0;
+    for (size_t start = 0; start < count; start += blockSize) {
+        size_t n = std::min(blockSize, count - start);
+        for (size_t i = 0; i < instructions.size(); ++i) {
+            const auto& instruction = instructions[i];
+            T* out = &buffer[i * blockSize];
+            switch (instruction.node->kind) {
+                case Kind::Constant:
+                    std::fill(out, out + n, static_cast<const ConstantNode*>(instruction.node)->value);
+                    break;
+                case Kind::Variable:
+                    std::copy(columns[instruction.first] + start, columns[instruction.first] + start + n, out);
+                    break;
+                case Kind::BinaryOperation: {
+                    char op = static_cast<const BinaryOperationNode*>(instruction.node)->op;
+                    const T* right = &buffer[instruction.second * blockSize];
+                    Expression<T>::applyBinaryBatch(op, &buffer[instruction.first * blockSize], right, out, n);
+                    if (op == '/') {
+                        bool zero = false;
+                        for (size_t p = 0; p < n; ++p) {
+                            zero |= right[p] == T(0);
+                        }
+                        errors |= zero ? DivisionByZero : 0u;
+                    }
+                    if (op == '^') {
+                        errors |= anyNotANumber(out, n) ? NotANumber : 0u;
+                    }
+                    break;
+                }
+                case Kind::UnaryOperation: {
+                    auto func = static_cast<const UnaryOperationNode*>(instruction.node)->func;
+                    const T* operand = &buffer[instruction.first * blockSize];
+                    Expression<T>::applyUnaryBatch(func, operand, out, n);
+                    if (func == Function::Ln) {
+                        bool domain = false;
+                        for (size_t p = 0; p < n; ++p) {
+                            domain |= outsideLogarithmDomain(operand[p]);
+                        }
+                        errors |= domain ? LogarithmDomain : 0u;
+                    }
+                    break;
+                }
+                case Kind::FunctionCall: {
+                    for (int k = 0; k < instruction.second; ++k) {
+                        arguments[k] = &buffer[functionOperands[instruction.first + k] * blockSize];
+                    }
+                    Expression<T>::applyFunctionBatch(*static_cast<const FunctionNode*>(instruction.node)->definition, arguments, out, n, point);
+                    errors |= anyNotANumber(out, n) ? NotANumber : 0u;
+                    break;
+                }
+                case Kind::Polynomial: {
+                    const auto& polynomial = *static_cast<const PolynomialNode*>(instruction.node);
+                    const T* base = &buffer[instruction.first * blockSize];
+                    for (size_t p = 0; p < n; ++p) {
+                        out[p] = Expression<T>::evaluatePolynomial(polynomial, base[p]);
+                    }
+                    break;
+                }
+            }
+        }
+        for (size_t k = 0; k < outputs.size(); ++k) {
+            const T* source = &buffer[outputs[k] * blockSize];
+            errors |= anyNotANumber(source, n) ? NotANumber : 0u;
+            std::copy(source, source + n, results[k] + start);
+        }
+    }
+    return errors;
+}
+
+template<typename T>
+Jacobian<T>::Jacobian(const std::vector<Expression<T>>& equations, const std::vector<std::string>& variables) : variables(variables) {
+    std::vector<std::vector<std::string>> referenced;
+    for (const auto& equation : equations) {
+        referenced.push_back(equation.variables());
+    }
+
+    std::vector<std::vector<std::pair<size_t, Expression<T>>>> rowEntries(equations.size());
+    for (size_t column = 0; column < variables.size(); ++column) {
+        std::vector<size_t> rowsWithVariable;
+        std::vector<Expression<T>> dependent;
+        for (size_t row = 0; row < equations.size(); ++row) {
+            if (std::binary_search(referenced[row].begin(), referenced[row].end(), variables[column])) {
+                rowsWithVariable.push_back(row);
+                dependent.push_back(equations[row]);
+            }
+        }
+        auto derivatives = Expression<T>::differentiateAll(dependent, variables[column]);
+        for (size_t k = 0; k < derivatives.size(); ++k) {
+            auto derivative = derivatives[k].simplify();
+            if (derivative.variables().empty() && derivative.evaluate({}) == T(0)) {
+                continue;
+            }
+            rowEntries[rowsWithVariable[k]].emplace_back(column, std::move(derivative));
+        }
+    }
+
+    rowStart.push_back(0);
+    for (auto& row : rowEntries) {
+        for (auto& [column, derivative] : row) {
+            entryColumns.push_back(column);
+            compiled.add(derivative);
+            entries.push_back(std::move(derivative));
+        }
+        rowStart.push_back(entries.size());
+    }
+}
+
+template<typename T>
+std::optional<std::vector<T>> Jacobian<T>::evaluate(const std::map<std::string, T>& values) const {
+    return compiled.evaluate(values);
+}
+
+template<typename T>
+std::optional<std::vector<std::vector<T>>> Jacobian<T>::evaluateBatch(const std::map<std::string, std::vector<T>>& values) const {
+    return compiled.evaluateBatch(values);
+}
+
+template<typename T>
+std::optional<std::vector<std::vector<T>>> Jacobian<T>::evaluateDense(const std::map<std::string, T>& values) const {
+    auto sparse = evaluate(values);
+    if (!sparse) {
+        return std::nullopt;
+    }
+    std::vector<std::vector<T>> dense(rows(), std::vector<T>(columns(), T(0)));
+    for (size_t row = 0; row < rows(); ++row) {
+        for (size_t k = rowStart[row]; k < rowStart[row + 1]; ++k) {
+            dense[row][entryColumns[k]] = (*sparse)[k];
+        }
+    }
+    return dense;
+}
+
+template<typename T>
+ExpressionCatalog<T>::ExpressionCatalog() : current(std::make_shared<const Formulas>()) {}
+
+template<typename T>
+typename ExpressionCatalog<T>::Snapshot ExpressionCatalog<T>::snapshot() const {
+    return std::atomic_load_explicit(&current, std::memory_order_acquire);
+}
+
+template<typename T>
+void ExpressionCatalog<T>::store(Snapshot next) {
+    std::atomic_store_explicit(&current, std::move(next), std::memory_order_release);
+}
+
+template<typename T>
+std::optional<Expression<T>> ExpressionCatalog<T>::find(const std::string& name) const {
+    auto formulas = snapshot();
+    auto it = formulas->find(name);
+    if (it == formulas->end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+template<typename T>
+size_t ExpressionCatalog<T>::size() const {
+    return snapshot()->size();
+}
+
+template<typename T>
+void ExpressionCatalog<T>::publish(const std::string& name, const Expression<T>& expr) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    auto next = std::make_shared<Formulas>(*snapshot());
+    next->insert_or_assign(name, expr);
+    store(std::move(next));
+}
+
+template<typename T>
+bool ExpressionCatalog<T>::remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    auto formulas = snapshot();
+    if (!formulas->count(name)) {
+        return false;
+    }
+    auto next = std::make_shared<Formulas>(*formulas);
+    next->erase(name);
+    store(std::move(next));
+    return true;
+}
+
+template<typename T>
+void ExpressionCatalog<T>::replaceAll(Formulas formulas) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    store(std::make_shared<const Formulas>(std::move(formulas)));
+}
+
+template<typename T>
+struct FormulaCache<T>::Writer {
+    Tables tables;
+    std::unordered_map<const Node*, uint32_t> written;
+    std::unordered_map<std::string, uint32_t> interned;
+
+    uint32_t intern(const std::string& value) {
+        auto [it, inserted] = interned.emplace(value, static_cast<uint32_t>(tables.strings.size()));
+        if (inserted) {
+            tables.strings.push_back({static_cast<uint32_t>(tables.characters.size()), static_cast<uint32_t>(value.size())});
+            tables.characters += value;
+        }
+        return it->second;
+    }
+
+    uint32_t constant(const T& value) {
+        tables.constants.push_back(value);
+        return static_cast<uint32_t>(tables.constants.size() - 1);
+    }
+
+    uint32_t node(const NodePtr& node) {
+        auto seen = written.find(node.get());
+        if (seen != written.end()) {
+            return seen->second;
+        }
+        NodeRecord record{static_cast<uint8_t>(node->kind), 0, 0, 0, 0, 0};
+        switch (node->kind) {
+            case Kind::Constant:
+                record.a = constant(static_cast<const ConstantNode&>(*node).value);
+                break;
+            case Kind::Variable:
+                record.a = intern(static_cast<const VariableNode&>(*node).name);
+                break;
+            case Kind::BinaryOperation: {
+                const auto& binary = static_cast<const BinaryOperationNode&>(*node);
+                record.op = static_cast<uint8_t>(binary.op);
+                record.a = this->node(binary.left);
+                record.b = this->node(binary.right);
+                break;
+            }
+            case Kind::UnaryOperation: {
+                const auto& unary = static_cast<const UnaryOperationNode&>(*node);
+                record.op = static_cast<uint8_t>(unary.func);
+                record.a = this->node(unary.operand);
+                break;
+            }
+            case Kind::FunctionCall: {
+                const auto& function = static_cast<const FunctionNode&>(*node);
+                std::vector<uint32_t> arguments;
+                for (const auto& argument : function.arguments) {
+                    arguments.push_back(this->node(argument));
+                }
+                record.a = intern(function.definition->name);
+                record.b = static_cast<uint32_t>(tables.indices.size());
+                record.c = static_cast<uint32_t>(arguments.size());
+                tables.indices.insert(tables.indices.end(), arguments.begin(), arguments.end());
+                break;
+            }
+            case Kind::Polynomial: {
+                const auto& polynomial = static_cast<const PolynomialNode&>(*node);
+                record.a = this->node(polynomial.base);
+                record.b = static_cast<uint32_t>(tables.indices.size());
+                record.c = static_cast<uint32_t>(polynomial.terms.size());
+                for (const auto& [exponent, coefficient] : polynomial.terms) {
+                    tables.indices.push_back(exponent);
+                    tables.indices.push_back(constant(coefficient));
+                }
+                break;
+            }
+        }
+        tables.nodes.push_back(record);
+        uint32_t index = static_cast<uint32_t>(tables.nodes.size() - 1);
+        written.emplace(node.get(), index);
+        return index;
+    }
+};
+
+namespace {
+
+constexpr char formulaCacheMagic[8] = {'E', 'X', 'P', 'R', 'T', 'R', 'E', 'E'};
+constexpr size_t formulaCacheAlignment = 16;
+
+template<typename V>
+void appendSection(std::string& payload, const std::vector<V>& values, uint64_t& offset, uint64_t& count) {
+    payload.resize((payload.size() + formulaCacheAlignment - 1) / formulaCacheAlignment * formulaCacheAlignment, '\0');
+    offset = payload.size();
+    count = values.size();
+    payload.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(V));
+}
+
+template<typename V>
+bool readSection(const std::string& payload, uint64_t offset, uint64_t count, V* target) {
+    if (offset > payload.size() || count > (payload.size() - offset) / sizeof(V)) {
+        return false;
+    }
+    std::memcpy(target, payload.data() + offset, count * sizeof(V));
+    return true;
+}
+
+}
+
+template<typename T>
+FormulaCache<T>::FormulaCache(std::string path) : path(std::move(path)) {
+    fromFile = load();
+    if (!fromFile) {
+        tables = Tables();
+    }
+    nodes.resize(tables.nodes.size());
+    for (size_t k = 0; k < tables.entries.size(); ++k) {
+        byHash[tables.entries[k].hash].push_back(formulas.size());
+        formulas.push_back({text(tables.entries[k].text), std::nullopt, static_cast<int>(k)});
+    }
+}
+
+template<typename T>
+size_t FormulaCache<T>::size() const {
+    return formulas.size();
+}
+
+template<typename T>
+uint64_t FormulaCache<T>::hash(const char* data, size_t size, uint64_t seed) {
+    for (size_t i = 0; i < size; ++i) {
+        seed = (seed ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return seed;
+}
+
+// FNV-1a по 64-битным словам: в восемь раз меньше умножений, чем побайтно.
+template<typename T>
+uint64_t FormulaCache<T>::checksum(const std::string& payload) {
+    uint64_t result = 14695981039346656037ull;
+    size_t words = payload.size() / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t word;
+        std::memcpy(&word, payload.data() + i * sizeof(uint64_t), sizeof(word));
+        result = (result ^ word) * 1099511628211ull;
+    }
+    return hash(payload.data() + words * sizeof(uint64_t), payload.size() % sizeof(uint64_t), result);
+}
+
+template<typename T>
+bool FormulaCache<T>::load() {
+    std::ifstream in(path, std::ios::binary);
+    Header header{};
+    if (!in || !in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+    if (std::memcmp(header.magic, formulaCacheMagic, sizeof(formulaCacheMagic)) != 0 || header.version != formatVersion ||
+        header.valueSize != sizeof(T) || header.complex != IsComplex<T>::value) {
+        return false;
+    }
+    auto start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::string payload(static_cast<size_t>(in.tellg() - start), '\0');
+    in.seekg(start);
+    if (!in.read(payload.data(), static_cast<std::streamsize>(payload.size())) || checksum(payload) != header.checksum) {
+        return false;
+    }
+
+    auto read = [&](const Section& section, auto& target) {
+        if (section.count > payload.size()) {
+            return false;
+        }
+        target.resize(section.count);
+        return readSection(payload, section.offset, section.count, target.data());
+    };
+    const Section* sections = header.sections;
+    if (!read(sections[0], tables.entries) || !read(sections[1], tables.derivatives) || !read(sections[2], tables.nodes) ||
+        !read(sections[3], tables.indices) || !read(sections[4], tables.constants) || !read(sections[5], tables.strings) ||
+        !read(sections[6], tables.characters)) {
+        return false;
+    }
+
+    // Контрольная сумма ловит повреждения, а ссылки между таблицами проверяются отдельно,
+    // чтобы ленивое восстановление не вышло за границы.
+    auto validString = [&](uint32_t id) {
+        return id < tables.strings.size() && tables.strings[id].offset <= tables.characters.size() &&
+               tables.strings[id].length <= tables.characters.size() - tables.strings[id].offset;
+    };
+    auto validRange = [&](uint32_t offset, uint64_t count) {
+        return offset <= tables.indices.size() && count <= tables.indices.size() - offset;
+    };
+    for (uint32_t index = 0; index < tables.nodes.size(); ++index) {
+        const auto& record = tables.nodes[index];
+        bool valid = false;
+        switch (static_cast<Kind>(record.kind)) {
+            case Kind::Constant:
+                valid = record.a < tables.constants.size();
+                break;
+            case Kind::Variable:
+                valid = validString(record.a);
+                break;
+            case Kind::BinaryOperation:
+                valid = record.a < index && record.b < index && std::strchr("+-*/^", record.op) && record.op != 0;
+                break;
+            case Kind::UnaryOperation:
+                valid = record.a < index && record.op <= static_cast<uint8_t>(Function::Exp);
+                break;
+            case Kind::FunctionCall:
+                valid = validString(record.a) && validRange(record.b, record.c);
+                for (uint32_t k = 0; valid && k < record.c; ++k) {
+                    valid = tables.indices[record.b + k] < index;
+                }
+                break;
+            case Kind::Polynomial:
+                valid = record.a < index && record.c > 0 && validRange(record.b, uint64_t(record.c) * 2);
+                for (uint32_t k = 0; valid && k < record.c; ++k) {
+                    valid = tables.indices[record.b + 2 * k + 1] < tables.constants.size();
+                }
+                break;
+        }
+        if (!valid) {
+            return false;
+        }
+    }
+    for (const auto& entry : tables.entries) {
+        if (!validString(entry.text) || entry.root >= tables.nodes.size() || entry.derivatives > tables.derivatives.size() ||
+            entry.derivativeCount > tables.derivatives.size() - entry.derivatives) {
+            return false;
+        }
+    }
+    for (const auto& derivative : tables.derivatives) {
+        if (!validString(derivative.variable) || derivative.node >= tables.nodes.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+std::string FormulaCache<T>::text(uint32_t id) const {
+    return tables.characters.substr(tables.strings[id].offset, tables.strings[id].length);
+}
+
+template<typename T>
+typename FormulaCache<T>::NodePtr FormulaCache<T>::materialize(uint32_t index) {
+    if (nodes[index]) {
+        return nodes[index];
+    }
+    const auto& record = tables.nodes[index];
+    NodePtr node;
+    switch (static_cast<Kind>(record.kind)) {
+        case Kind::Constant:
+            node = std::make_shared<ConstantNode>(tables.constants[record.a]);
+            break;
+        case Kind::Variable:
+            node = std::make_shared<VariableNode>(text(record.a));
+            break;
+        case Kind::BinaryOperation:
+            node = std::make_shared<BinaryOperationNode>(static_cast<char>(record.op), materialize(record.a), materialize(record.b));
+            break;
+        case Kind::UnaryOperation:
+            node = std::make_shared<UnaryOperationNode>(static_cast<Function>(record.op), materialize(record.a));
+            break;
+        case Kind::FunctionCall: {
+            std::string name = text(record.a);
+            int id;
+            auto definition = Expression<T>::lookupFunction(name, id);
+            if (!definition) {
+                throw std::invalid_argument("неизвестная функция: " + name);
+            }
+            if (definition->arity != record.c) {
+                throw std::invalid_argument("неверное число аргументов функции " + name);
+            }
+            std::vector<NodePtr> arguments;
+            for (uint32_t k = 0; k < record.c; ++k) {
+                arguments.push_back(materialize(tables.indices[record.b + k]));
+            }
+            node = std::make_shared<FunctionNode>(id, definition, std::move(arguments));
+            break;
+        }
+        case Kind::Polynomial: {
+            std::vector<std::pair<unsigned, T>> terms;
+            for (uint32_t k = 0; k < record.c; ++k) {
+                terms.emplace_back(tables.indices[record.b + 2 * k], tables.constants[tables.indices[record.b + 2 * k + 1]]);
+            }
+            node = std::make_shared<PolynomialNode>(materialize(record.a), std::move(terms));
+            break;
+        }
+    }
+    nodes[index] = node;
+    return node;
+}
+
+template<typename T>
+Expression<T> FormulaCache<T>::prepare(const Formula& formula) {
+    using DerivativeCache = typename Expression<T>::DerivativeCache;
+    const auto& entry = tables.entries[formula.entry];
+    auto cache = std::make_shared<DerivativeCache>();
+    for (uint32_t k = entry.derivatives; k < entry.derivatives + entry.derivativeCount; ++k) {
+        const auto& derivative = tables.derivatives[k];
+        cache->entries[text(derivative.variable)].derivative = Expression<T>(materialize(derivative.node), std::make_shared<DerivativeCache>());
+    }
+    return Expression<T>(materialize(entry.root), std::move(cache));
+}
+
+template<typename T>
+Expression<T> FormulaCache<T>::parse(const std::string& formula) {
+    auto& candidates = byHash[hash(formula.data(), formula.size())];
+    for (size_t index : candidates) {
+        auto& cached = formulas[index];
+        if (cached.text == formula) {
+            ++hitCount;
+            if (!cached.expression) {
+                cached.expression = prepare(cached);
+            }
+            return *cached.expression;
+        }
+    }
+    ++missCount;
+    // Кэш производных создаётся сразу, чтобы его разделяли все копии и его увидел save.
+    Expression<T> expr(Expression<T>::fromString(formula).root, std::make_shared<typename Expression<T>::DerivativeCache>());
+    candidates.push_back(formulas.size());
+    formulas.push_back({formula, expr, -1});
+    return expr;
+}
+
+template<typename T>
+void FormulaCache<T>::save() {
+    Writer writer;
+    writer.written.reserve(tables.nodes.size() + formulas.size() * 16);
+    for (auto& formula : formulas) {
+        if (!formula.expression) {
+            formula.expression = prepare(formula);
+        }
+        EntryRecord entry{hash(formula.text.data(), formula.text.size()), writer.intern(formula.text),
+                          writer.node(formula.expression->root), static_cast<uint32_t>(writer.tables.derivatives.size()), 0};
+        if (auto cache = formula.expression->loadCache()) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            for (const auto& [variable, cached] : cache->entries) {
+                if (cached.derivative) {
+                    writer.tables.derivatives.push_back({writer.intern(variable), writer.node(cached.derivative->root)});
+                    entry.derivativeCount++;
+                }
+            }
+        }
+        writer.tables.entries.push_back(entry);
+    }
+
+    const auto& out = writer.tables;
+    Header header{};
+    std::memcpy(header.magic, formulaCacheMagic, sizeof(formulaCacheMagic));
+    header.version = formatVersion;
+    header.valueSize = sizeof(T);
+    header.complex = IsComplex<T>::value;
+    std::string payload;
+    appendSection(payload, out.entries, header.sections[0].offset, header.sections[0].count);
+    appendSection(payload, out.derivatives, header.sections[1].offset, header.sections[1].count);
+    appendSection(payload, out.nodes, header.sections[2].offset, header.sections[2].count);
+    appendSection(payload, out.indices, header.sections[3].offset, header.sections[3].count);
+    appendSection(payload, out.constants, header.sections[4].offset, header.sections[4].count);
+    appendSection(payload, out.strings, header.sections[5].offset, header.sections[5].count);
+    appendSection(payload, std::vector<char>(out.characters.begin(), out.characters.end()), header.sections[6].offset, header.sections[6].count);
+    header.checksum = checksum(payload);
+
+    // Запись во временный файл и переименование: читатель не увидит недописанный кэш.
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        if (!file) {
+            throw std::runtime_error("не удалось записать кэш формул: " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("не удалось записать кэш формул: " + path);
     }
-    return oss.str();
 }
 
 template class Expression<double>;
-template class Expression<std::complex<double>>;
\ No newline at end of file
+template class Expression<std::complex<double>>;
+template class Expression<float>;
+template class Expression<std::complex<float>>;
+template class Expression<long double>;
+
+template class ExpressionSet<double>;
+template class ExpressionSet<std::complex<double>>;
+template class ExpressionSet<float>;
+template class ExpressionSet<std::complex<float>>;
+template class ExpressionSet<long double>;
+
+template class Jacobian<double>;
+template class Jacobian<std::complex<double>>;
+template class Jacobian<float>;
+template class Jacobian<std::complex<float>>;
+template class Jacobian<long double>;
+
+template class ExpressionCatalog<double>;
+template class ExpressionCatalog<std::complex<double>>;
+template class ExpressionCatalog<float>;
+template class ExpressionCatalog<std::complex<float>>;
+template class ExpressionCatalog<long double>;
+
+template class FormulaCache<double>;
+template class FormulaCache<std::complex<double>>;
+template class FormulaCache<float>;
+template class FormulaCache<std::complex<float>>;
+template class FormulaCache<long double>;
+
+template void printResult<double>(const double&);
+template void printResult<std::complex<double>>(const std::complex<double>&);
+template void printResult<float>(const float&);
+template void printResult<std::complex<float>>(const std::complex<float>&);
+template void printResult<long double>(const long double&);
\ No newline at end of file
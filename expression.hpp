@@ -7,13 +7,39 @@
 #include <optional>
 #include <vector>
 #include <cctype>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
+#ifdef EXPRESSION_PROFILING
+#define EXPRESSION_PROFILE_ALLOCATION() (++counters.allocations)
+#else
+#define EXPRESSION_PROFILE_ALLOCATION()
+#endif
 
 template<typename T>
-void printResult(const T& value);
+struct IsComplex : std::false_type {};
+
+template<typename T>
+struct IsComplex<std::complex<T>> : std::true_type {};
 
-template<>
-void printResult<std::complex<double>>(const std::complex<double>& value);
+template<typename T>
+class ExpressionSet;
 
+template<typename T>
+class FormulaCache;
+
+template<typename T>
+void printResult(const T& value);
+
+// Выражение неизменяемо: копия разделяет дерево узлов со счётчиком ссылок и стоит O(1),
+// а все const-методы можно вызывать одновременно из разных потоков.
 template<typename T>
 class Expression {
 public:
@@ -33,6 +59,7 @@ public:
     Expression operator*(const Expression& other) const;
     Expression operator/(const Expression& other) const;
     Expression operator^(const Expression& other) const;
+    Expression operator-() const;
 
     Expression sin() const;
     Expression cos() const;
@@ -41,192 +68,615 @@ public:
 
     Expression simplify() const;
 
+    // Многочлены от одной переменной (константы, +, -, *, деление на константу и целые
+    // степени) сворачиваются в узлы с разреженными коэффициентами, которые вычисляются
+    // по схеме Горнера и дифференцируются прямо по коэффициентам. Дробь двух многочленов
+    // становится делением двух таких узлов.
+    Expression toPolynomialForm() const;
+
+    // Коэффициенты от младшей степени к старшей, если всё выражение — многочлен от variable.
+    std::optional<std::vector<T>> polynomialCoefficients(const std::string& variable) const;
+
+    // Коэффициенты ряда Тейлора по variable в точке point, c[k] = f^(k)(point) / k! для k <= order.
+    // Считаются в арифметике усечённых степенных рядов за O(order^2) на узел вместо повторного
+    // дифференцирования; зарегистрированные функции раскладываются через свои частные производные.
+    // Остальные переменные берутся из parameters, nullopt — если какая-то не задана.
+    std::optional<std::vector<T>> taylorCoefficients(const std::string& variable, T point, unsigned order,
+                                                     const std::map<std::string, T>& parameters = {}) const;
+
+    // Многочлен Тейлора как дешёвая замена выражения вблизи point: узел многочлена от (variable - point).
+    std::optional<Expression> taylorPolynomial(const std::string& variable, T point, unsigned order,
+                                               const std::map<std::string, T>& parameters = {}) const;
+
     Expression substitute(const std::string& variable, T value) const;
 
     std::optional<T> evaluate(const std::map<std::string, T>& variables) const;
 
+    std::optional<std::vector<T>> evaluateBatch(const std::map<std::string, std::vector<T>>& variables) const;
+
     std::string toString() const;
 
     std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const;
 
     static Expression fromString(const std::string& expr);
 
+    // Производные кэшируются в выражении по имени переменной вместе с упрощённой и
+    // скомпилированной формой; копии выражения разделяют кэш. Узлы неизменяемы, поэтому
+    // записи не устаревают, а присваивание заменяет корень вместе с кэшем.
     Expression differentiate(const std::string& variable) const;
+    Expression simplifiedDerivative(const std::string& variable) const;
+    std::shared_ptr<const ExpressionSet<T>> compiledDerivative(const std::string& variable) const;
 
-private:
-    struct Node {
-        virtual ~Node() = default;
-        virtual std::optional<T> evaluate(const std::map<std::string, T>& variables) const = 0;
-        virtual std::string toString() const = 0;
-        virtual std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const = 0;
-        virtual std::unique_ptr<Node> clone() const = 0;
-        virtual std::unique_ptr<Node> substitute(const std::string& variable, T value) = 0;
-        virtual int precedence() const = 0;
-        virtual std::unique_ptr<Node> differentiate(const std::string& variable) const = 0;
+    // Производные нескольких выражений по одной переменной; общие подвыражения дифференцируются один раз.
+    static std::vector<Expression> differentiateAll(const std::vector<Expression>& expressions, const std::string& variable);
+
+    std::vector<std::string> variables() const;
+
+    // Функция произвольной арности. evaluateBatch необязателен: по умолчанию вызывается evaluate
+    // для каждой точки. partialDerivative(args, k) возвращает производную по k-му аргументу.
+    struct FunctionDefinition {
+        std::string name;
+        size_t arity = 1;
+        std::function<T(const T* arguments)> evaluate;
+        std::function<void(const T* const* arguments, T* result, size_t count)> evaluateBatch;
+        std::function<Expression(const std::vector<Expression>& arguments, size_t index)> partialDerivative;
     };
 
-    struct ConstantNode : Node {
-        T value;
-        ConstantNode(T value) : value(value) {}
-        std::optional<T> evaluate(const std::map<std::string, T>& variables) const override { return value; }
-        std::string toString() const override;
-        std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const override {
-            return toString();
-        }
-        std::unique_ptr<Node> clone() const override { return std::make_unique<ConstantNode>(value); }
-        std::unique_ptr<Node> substitute(const std::string& variable, T value) override {
-            return clone();
+    static int registerFunction(FunctionDefinition definition);
+    static std::optional<int> functionId(const std::string& name);
+    static Expression call(const std::string& name, const std::vector<Expression>& arguments);
+
+    // Счётчики — по дереву (общее поддерево учитывается при каждом вхождении, насыщаются на
+    // SIZE_MAX), но считаются за один проход по уникальным узлам DAG, так что statistics()
+    // остаётся дешёвым и для производных с экспоненциально большим деревом.
+    struct Statistics {
+        size_t constants = 0;
+        size_t variables = 0;
+        size_t binaryOperations = 0;
+        size_t unaryOperations = 0;
+        size_t functionCalls = 0;
+        size_t polynomials = 0;
+        size_t depth = 0;
+        size_t nodes() const {
+            size_t total = 0;
+            for (size_t count : {constants, variables, binaryOperations, unaryOperations, functionCalls, polynomials}) {
+                total = saturatingAdd(total, count);
+            }
+            return total;
         }
-        int precedence() const override { return 0; }
-        std::unique_ptr<Node> differentiate(const std::string& variable) const override {
-            return std::make_unique<ConstantNode>(0);
+        static size_t saturatingAdd(size_t a, size_t b) {
+            return a > std::numeric_limits<size_t>::max() - b ? std::numeric_limits<size_t>::max() : a + b;
         }
     };
 
-    struct VariableNode : Node {
-        std::string name;
-        VariableNode(const std::string& name) : name(name) {}
-        std::optional<T> evaluate(const std::map<std::string, T>& variables) const override;
-        std::string toString() const override { return name; }
-        std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const override {
-            auto it = variables.find(name);
-            if (it != variables.end()) {
-                std::ostringstream oss;
-                oss << it->second;
-                return oss.str();
+    // Счётчики накапливаются только при сборке с -DEXPRESSION_PROFILING, иначе profile() возвращает нули.
+    struct Profile {
+        size_t allocations = 0;
+        double parseSeconds = 0;
+        double simplifySeconds = 0;
+        double differentiateSeconds = 0;
+        double evaluateSeconds = 0;
+    };
+
+    Statistics statistics() const;
+
+    // nodes и bytes — уникальные узлы DAG и оценка занимаемой ими памяти, treeNodes — размер
+    // того же выражения в виде дерева (общие поддеревья считаются при каждом вхождении, насыщается
+    // на 2^32 - 1). Большое отношение treeNodes / nodes означает, что выражение держится только за
+    // счёт разделения и toString или evaluate по дереву для него дороги.
+    struct Footprint {
+        size_t nodes = 0;
+        size_t bytes = 0;
+        size_t treeNodes = 0;
+    };
+
+    Footprint footprint() const;
+
+    // Ограничения на память для всех операций текущего потока, пока жив BudgetScope: fromString,
+    // differentiate, substitute, simplify и арифметика. nodes и bytes ограничивают новые узлы,
+    // treeNodes — размер в виде дерева любого нового узла. Превышение прерывает операцию на
+    // первом лишнем узле исключением std::length_error. При shareOversizedTrees большое дерево
+    // не прерывает операцию: оно остаётся общим DAG (degraded() == true), а toString для него
+    // отказывает, вместо того чтобы строить строку размером с развёрнутое дерево. Вложенный
+    // BudgetScope не заменяет внешний: каждый узел списывается со всех активных бюджетов потока.
+    struct Budget {
+        size_t nodes = std::numeric_limits<size_t>::max();
+        size_t bytes = std::numeric_limits<size_t>::max();
+        size_t treeNodes = std::numeric_limits<size_t>::max();
+        bool shareOversizedTrees = false;
+    };
+
+    class BudgetScope {
+    public:
+        explicit BudgetScope(Budget budget);
+        ~BudgetScope();
+        BudgetScope(const BudgetScope&) = delete;
+        BudgetScope& operator=(const BudgetScope&) = delete;
+
+        size_t nodes() const { return usedNodes; }
+        size_t bytes() const { return usedBytes; }
+        bool degraded() const { return oversized; }
+
+    private:
+        friend class Expression;
+
+        Budget budget;
+        size_t treeLimit;
+        size_t usedNodes = 0;
+        size_t usedBytes = 0;
+        bool oversized = false;
+        BudgetScope* previous;
+
+        void charge(size_t bytes, uint32_t weight);
+    };
+
+    static bool profilingEnabled();
+    static Profile profile();
+    static void resetProfile();
+
+    struct CacheStatistics {
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+    static CacheStatistics cacheStatistics();
+    static void resetCacheStatistics();
+
+private:
+    friend class ExpressionSet<T>;
+    friend class FormulaCache<T>;
+
+#ifdef EXPRESSION_PROFILING
+    struct ProfileCounters {
+        std::atomic<size_t> allocations{0};
+        std::atomic<int64_t> parseNanoseconds{0};
+        std::atomic<int64_t> simplifyNanoseconds{0};
+        std::atomic<int64_t> differentiateNanoseconds{0};
+        std::atomic<int64_t> evaluateNanoseconds{0};
+    };
+    static ProfileCounters counters;
+#endif
+
+    enum class Kind : uint8_t { Constant, Variable, BinaryOperation, UnaryOperation, FunctionCall, Polynomial };
+    enum class Function : uint8_t { Negate, Sin, Cos, Ln, Exp };
+
+    // Узлы неизменяемы и разделяются между выражениями; удаление идёт через deleter
+    // конкретного типа из make_shared, поэтому виртуальный деструктор не нужен.
+    static thread_local BudgetScope* activeBudget;
+
+    // weight — размер поддерева в виде дерева, считается за O(1) при создании узла. Поле идёт
+    // первым, чтобы kind и однобайтовые поля наследников легли в хвостовое выравнивание.
+    struct Node {
+        const uint32_t weight;
+        const Kind kind;
+        Node(Kind kind, size_t bytes, size_t weight)
+            : weight(static_cast<uint32_t>(std::min<size_t>(weight, std::numeric_limits<uint32_t>::max()))), kind(kind) {
+            EXPRESSION_PROFILE_ALLOCATION();
+            if (activeBudget) {
+                activeBudget->charge(bytes, this->weight);
             }
-            return name;
         }
-        std::unique_ptr<Node> clone() const override { return std::make_unique<VariableNode>(name); }
-        std::unique_ptr<Node> substitute(const std::string& variable, T value) override;
-        int precedence() const override { return 0; }
-        std::unique_ptr<Node> differentiate(const std::string& variable) const override {
-            if (name == variable) {
-                return std::make_unique<ConstantNode>(1);
-            }
-            return std::make_unique<ConstantNode>(0);
+    };
+
+    using NodePtr = std::shared_ptr<const Node>;
+
+    // Оценка памяти узла: сам объект, блок счётчиков make_shared и динамические части.
+    static constexpr size_t sharedOverhead = 2 * sizeof(void*);
+
+    static size_t weightOf(const std::vector<NodePtr>& nodes) {
+        size_t weight = 1;
+        for (const auto& node : nodes) {
+            weight += node->weight;
         }
+        return weight;
+    }
+
+    struct ConstantNode : Node {
+        const T value;
+        ConstantNode(T value) : Node(Kind::Constant, sizeof(ConstantNode) + sharedOverhead, 1), value(value) {}
+    };
+
+    struct VariableNode : Node {
+        const std::string name;
+        VariableNode(const std::string& name)
+            : Node(Kind::Variable, sizeof(VariableNode) + sharedOverhead + name.size(), 1), name(name) {}
     };
 
     struct BinaryOperationNode : Node {
-        char op;
-        std::unique_ptr<Node> left, right;
-        BinaryOperationNode(char op, std::unique_ptr<Node> left, std::unique_ptr<Node> right) : op(op), left(std::move(left)), right(std::move(right)) {}
-        std::optional<T> evaluate(const std::map<std::string, T>& variables) const override;
-        std::string toString() const override;
-        std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const override;
-        std::unique_ptr<Node> clone() const override {
-            return std::make_unique<BinaryOperationNode>(op, left->clone(), right->clone());
-        }
-        std::unique_ptr<Node> substitute(const std::string& variable, T value) override {
-            auto newLeft = left->substitute(variable, value);
-            auto newRight = right->substitute(variable, value);
-            return std::make_unique<BinaryOperationNode>(op, std::move(newLeft), std::move(newRight));
-        }
-        int precedence() const override {
-            switch (op) {
-                case '^': return 4;
-                case '*': case '/': return 3;
-                case '+': case '-': return 2;
-                default: return 1;
-            }
-        }
-        std::unique_ptr<Node> differentiate(const std::string& variable) const override {
-            auto leftDiff = left->differentiate(variable);
-            auto rightDiff = right->differentiate(variable);
-
-            switch (op) {
-                case '+': return std::make_unique<BinaryOperationNode>('+', std::move(leftDiff), std::move(rightDiff));
-                case '-': return std::make_unique<BinaryOperationNode>('-', std::move(leftDiff), std::move(rightDiff));
-                case '*': {
-                    auto leftRight = std::make_unique<BinaryOperationNode>('*', left->clone(), std::move(rightDiff));
-                    auto rightLeft = std::make_unique<BinaryOperationNode>('*', right->clone(), std::move(leftDiff));
-                    return std::make_unique<BinaryOperationNode>('+', std::move(leftRight), std::move(rightLeft));
-                }
-                case '/': {
-                    auto numerator1 = std::make_unique<BinaryOperationNode>('*', left->clone(), std::move(rightDiff));
-                    auto numerator2 = std::make_unique<BinaryOperationNode>('*', right->clone(), std::move(leftDiff));
-                    auto numerator = std::make_unique<BinaryOperationNode>('-', std::move(numerator1), std::move(numerator2));
-                    auto denominator = std::make_unique<BinaryOperationNode>('^', right->clone(), std::make_unique<ConstantNode>(2));
-                    return std::make_unique<BinaryOperationNode>('/', std::move(numerator), std::move(denominator));
-                }
-                case '^': {
-                    if (right->toString() == "2") {
-                        return std::make_unique<BinaryOperationNode>('*', std::make_unique<ConstantNode>(2), left->clone());
-                    }
-                    return std::make_unique<BinaryOperationNode>('*', right->clone(), std::make_unique<BinaryOperationNode>('^', left->clone(), std::make_unique<ConstantNode>(std::stod(right->toString()) - 1)));
-                }
-                default: throw std::invalid_argument("неизвестный оператор");
-            }
-        }
+        const char op;
+        const NodePtr left, right;
+        BinaryOperationNode(char op, NodePtr left, NodePtr right)
+            : Node(Kind::BinaryOperation, sizeof(BinaryOperationNode) + sharedOverhead, size_t(1) + left->weight + right->weight),
+              op(op), left(std::move(left)), right(std::move(right)) {}
     };
 
     struct UnaryOperationNode : Node {
-        std::string func;
-        std::unique_ptr<Node> operand;
-        UnaryOperationNode(const std::string& func, std::unique_ptr<Node> operand) : func(func), operand(std::move(operand)) {}
-    
-        std::optional<T> evaluate(const std::map<std::string, T>& variables) const override;
-        std::string toString() const override;
-        std::string toStringWithSubstitution(const std::map<std::string, T>& variables) const override;
-    
-        std::unique_ptr<Node> clone() const override {
-            return std::make_unique<UnaryOperationNode>(func, operand->clone());
-        }
-    
-        std::unique_ptr<Node> substitute(const std::string& variable, T value) override {
-            auto newOperand = operand->substitute(variable, value);
-            return std::make_unique<UnaryOperationNode>(func, std::move(newOperand));
-        }
-    
-        int precedence() const override { return 5; }
-    
-        std::unique_ptr<Node> differentiate(const std::string& variable) const override {
-            if (func == "-") {
-                auto operandDiff = operand->differentiate(variable);
-                return std::make_unique<UnaryOperationNode>("-", std::move(operandDiff));
-            }
-            if (func == "sin") {
-                auto cosNode = std::make_unique<UnaryOperationNode>("cos", operand->clone());
-                auto operandDiff = operand->differentiate(variable);
-                return std::make_unique<BinaryOperationNode>('*', std::move(cosNode), std::move(operandDiff));
-            }
-            if (func == "cos") {
-                auto sinNode = std::make_unique<UnaryOperationNode>("sin", operand->clone());
-                auto operandDiff = operand->differentiate(variable);
-                auto negSinNode = std::make_unique<UnaryOperationNode>("-", std::move(sinNode));
-                return std::make_unique<BinaryOperationNode>('*', std::move(negSinNode), std::move(operandDiff));
-            }
-            if (func == "ln") {
-                auto operandDiff = operand->differentiate(variable);
-                return std::make_unique<BinaryOperationNode>('/', std::move(operandDiff), operand->clone());
-            }
-            if (func == "exp") {
-                auto expNode = std::make_unique<UnaryOperationNode>("exp", operand->clone());
-                auto operandDiff = operand->differentiate(variable);
-                return std::make_unique<BinaryOperationNode>('*', std::move(expNode), std::move(operandDiff));
-            }
-            throw std::invalid_argument("неизвестная функция");
-        }
+        const Function func;
+        const NodePtr operand;
+        UnaryOperationNode(Function func, NodePtr operand)
+            : Node(Kind::UnaryOperation, sizeof(UnaryOperationNode) + sharedOverhead, size_t(1) + operand->weight),
+              func(func), operand(std::move(operand)) {}
     };
 
-    std::unique_ptr<Node> root;
+    struct FunctionNode : Node {
+        const int id;
+        const FunctionDefinition* const definition;
+        const std::vector<NodePtr> arguments;
+        FunctionNode(int id, const FunctionDefinition* definition, std::vector<NodePtr> arguments)
+            : Node(Kind::FunctionCall, sizeof(FunctionNode) + sharedOverhead + arguments.size() * sizeof(NodePtr), weightOf(arguments)),
+              id(id), definition(definition), arguments(std::move(arguments)) {}
+    };
+
+    // Слагаемые coefficient * base ^ exponent по убыванию степени, без нулевых коэффициентов.
+    struct PolynomialNode : Node {
+        const NodePtr base;
+        const std::vector<std::pair<unsigned, T>> terms;
+        PolynomialNode(NodePtr base, std::vector<std::pair<unsigned, T>> terms)
+            : Node(Kind::Polynomial, sizeof(PolynomialNode) + sharedOverhead + terms.size() * sizeof(std::pair<unsigned, T>),
+                   size_t(1) + terms.size() * (size_t(3) + base->weight)), base(std::move(base)), terms(std::move(terms)) {}
+    };
+
+    struct FunctionRegistry {
+        std::mutex mutex;
+        std::deque<FunctionDefinition> definitions;
+        std::map<std::string, int> ids;
+    };
 
-    Expression(std::unique_ptr<Node> root) : root(std::move(root)) {}
+    static FunctionRegistry& registry();
+    static void registerBuiltinFunctions(FunctionRegistry& registry);
+    static int addFunction(FunctionRegistry& registry, FunctionDefinition definition);
+    static const FunctionDefinition* lookupFunction(const std::string& name, int& id);
+
+    static const ConstantNode* asConstant(const Node& node) {
+        return node.kind == Kind::Constant ? static_cast<const ConstantNode*>(&node) : nullptr;
+    }
+
+    static T integerPower(T base, unsigned exponent);
+    static T power(const T& base, const T& exponent);
+    static T evaluatePolynomial(const PolynomialNode& polynomial, const T& base);
+    static T applyBinary(char op, const T& left, const T& right);
+    static T applyUnary(Function func, const T& value);
+    static void applyBinaryBatch(char op, const T* left, const T* right, T* result, size_t count);
+    static void applyUnaryBatch(Function func, const T* operand, T* result, size_t count);
+    static void applyFunctionBatch(const FunctionDefinition& definition, const T* const* arguments, T* result, size_t count, T* point);
+    static std::optional<T> evaluateNode(const Node& node, const std::map<std::string, T>& variables);
+    static bool evaluateBatchNode(const Node& node, const std::map<std::string, std::vector<T>>& variables, size_t count, std::vector<T>& result);
+    static std::string toStringNode(const Node& node, const std::map<std::string, T>* variables);
+    static std::string constantToString(const T& value);
+    static size_t nodeBytes(const Node& node);
+    static int precedence(const Node& node);
+    using NodeMemo = std::unordered_map<const Node*, NodePtr>;
+
+    static NodePtr substituteNode(const NodePtr& node, const std::string& variable, T value, NodeMemo& memo);
+    static NodePtr replaceNode(const NodePtr& node, const std::string& variable, T value, NodeMemo& memo);
+
+    static NodePtr differentiateNode(const NodePtr& node, const std::string& variable, NodeMemo& memo);
+    static NodePtr deriveNode(const NodePtr& node, const std::string& variable, NodeMemo& memo);
+    using StatisticsMemo = std::unordered_map<const Node*, Statistics>;
+    static const Statistics& collectNode(const Node& node, StatisticsMemo& memo);
+    static const char* functionName(Function func);
+    static std::optional<Function> functionFromName(const std::string& name);
+
+    struct DerivativeCache;
+    using CachePtr = std::shared_ptr<DerivativeCache>;
+
+    static std::atomic<size_t> cacheHits;
+    static std::atomic<size_t> cacheMisses;
+
+    // Доступ к cache только через atomic_load/atomic_store: обычный shared_ptr, а не
+    // std::atomic<shared_ptr>, чтобы раскладка класса не зависела от стандарта сборки.
+    NodePtr root;
+    mutable CachePtr cache;
+
+    Expression(NodePtr root, CachePtr cache = nullptr);
+
+    CachePtr loadCache() const;
+    void storeCache(CachePtr next) const;
+    DerivativeCache& derivativeCache() const;
     
-    static std::unique_ptr<Node> simplifyNode(std::unique_ptr<Node> node);
+    static NodePtr simplifyNode(const NodePtr& node, NodeMemo& memo);
+
+    static constexpr unsigned maxPolynomialDegree = 32;
+
+    // expandedPower: коэффициенты получены раскрытием степени многочлена из нескольких слагаемых.
+    // Для polynomialCoefficients это нужно, а toPolynomialForm такую степень не раскрывает:
+    // (x - 1) ^ 20 в базисе x ^ k вблизи корня теряет все значащие цифры.
+    struct PolynomialTerms {
+        std::string variable;
+        std::map<unsigned, T> coefficients;
+        bool expandedPower = false;
+    };
+    using PolynomialMemo = std::unordered_map<const Node*, std::optional<PolynomialTerms>>;
+
+    static const std::optional<PolynomialTerms>& extractPolynomial(const NodePtr& node, PolynomialMemo& polynomials);
+    static std::optional<PolynomialTerms> combinePolynomials(const Node& node, PolynomialMemo& polynomials);
+    static NodePtr makePolynomial(NodePtr base, std::vector<std::pair<unsigned, T>> terms);
+    static NodePtr polynomialNode(const NodePtr& node, PolynomialMemo& polynomials, NodeMemo& memo);
+    static NodePtr expandPolynomial(const PolynomialNode& polynomial);
+    static NodePtr reduceNode(const NodePtr& node, NodeMemo& memo);
+
+    using Series = std::vector<T>;
+
+    struct TaylorContext {
+        const std::string& variable;
+        T point;
+        const std::map<std::string, T>& parameters;
+        std::unordered_map<const Node*, Series> memo;
+        // Деревья частных производных по (узлу, номеру аргумента) строятся один раз и держат
+        // свои узлы живыми до конца разложения: memo хранит их адреса.
+        std::map<std::pair<const Node*, size_t>, NodePtr> partials;
+    };
+
+    static const Series* taylorNode(const NodePtr& node, size_t length, TaylorContext& context);
+    static bool expandTaylor(const NodePtr& node, size_t length, TaylorContext& context, Series& result);
+    static Series seriesProduct(const Series& left, const Series& right, size_t length);
+    static Series seriesQuotient(const Series& left, const Series& right, size_t length);
+    static Series seriesIntegerPower(Series base, unsigned exponent, size_t length);
+    static Series seriesPower(const Series& base, T exponent, size_t length);
+    static Series seriesExp(const Series& operand, size_t length);
+    static Series seriesLn(const Series& operand, size_t length);
+    static Series seriesSqrt(const Series& operand, size_t length);
+    static void seriesSinCos(const Series& operand, size_t length, Series& sine, Series& cosine);
     static void skipWhitespace(const std::string& expr, size_t& pos);
-    static std::unique_ptr<Node> parseUnary(const std::string& expr, size_t& pos);
-    static std::unique_ptr<Node> parseExpression(const std::string& expr, size_t& pos);
-    static std::unique_ptr<Node> parseTerm(const std::string& expr, size_t& pos);
-    static std::unique_ptr<Node> parseFactor(const std::string& expr, size_t& pos);
-    static std::unique_ptr<Node> parsePrimary(const std::string& expr, size_t& pos);
+    static NodePtr parseUnary(const std::string& expr, size_t& pos);
+    static NodePtr parseExpression(const std::string& expr, size_t& pos);
+    static NodePtr parseTerm(const std::string& expr, size_t& pos);
+    static NodePtr parseFactor(const std::string& expr, size_t& pos);
+    static NodePtr parsePrimary(const std::string& expr, size_t& pos);
+};
+
+// Несколько выражений, слитых в один DAG: одинаковые подвыражения (в том числе из разных
+// выражений) вычисляются один раз, а все выходы считаются за один проход по ленте инструкций.
+template<typename T>
+class ExpressionSet {
+public:
+    ExpressionSet() = default;
+    ExpressionSet(const std::vector<Expression<T>>& expressions);
+
+    size_t add(const Expression<T>& expr);
+
+    size_t size() const { return outputs.size(); }
+    size_t instructionCount() const { return instructions.size(); }
+    const std::vector<std::string>& variableNames() const { return names; }
+
+    std::optional<std::vector<T>> evaluate(const std::map<std::string, T>& variables) const;
+    std::optional<std::vector<std::vector<T>>> evaluateBatch(const std::map<std::string, std::vector<T>>& variables) const;
+
+    // Флаги ошибок области определения за пакет; сами значения при этом становятся inf/NaN.
+    enum Error : uint32_t {
+        DivisionByZero = 1u << 0,
+        LogarithmDomain = 1u << 1,
+        NotANumber = 1u << 2,
+        StaleBinding = 1u << 3,
+    };
+
+    // Номера столбцов и рабочая память одного вызывающего потока для evaluateBound.
+    class Binding {
+    public:
+        const std::vector<size_t>& columns() const { return indices; }
+
+    private:
+        friend class ExpressionSet;
+
+        std::vector<size_t> indices;
+        std::vector<const T*> bound;
+        std::vector<T> buffer;
+        std::vector<const T*> arguments;
+        std::vector<T> point;
+    };
+
+    // Горячий путь: bind один раз проверяет, что каждая переменная набора есть среди columns
+    // (иначе invalid_argument), и заранее выделяет всю рабочую память. evaluateBound затем не
+    // выделяет память и не бросает исключений (ядра зарегистрированных функций тоже не должны):
+    // columns[k] — значения k-го столбца из bind, outputs[j] — буфер на count значений для j-го
+    // выхода. Возвращает объединение флагов Error; StaleBinding — набор изменился после bind,
+    // и тогда ничего не вычисляется. Binding нельзя использовать из нескольких потоков сразу.
+    Binding bind(const std::vector<std::string>& columns) const;
+    uint32_t evaluateBound(Binding& binding, const T* const* columns, size_t count, T* const* outputs) const noexcept;
+
+private:
+    using Node = typename Expression<T>::Node;
+    using NodePtr = typename Expression<T>::NodePtr;
+    using Kind = typename Expression<T>::Kind;
+    using Function = typename Expression<T>::Function;
+    using ConstantNode = typename Expression<T>::ConstantNode;
+    using VariableNode = typename Expression<T>::VariableNode;
+    using BinaryOperationNode = typename Expression<T>::BinaryOperationNode;
+    using UnaryOperationNode = typename Expression<T>::UnaryOperationNode;
+    using FunctionNode = typename Expression<T>::FunctionNode;
+    using PolynomialNode = typename Expression<T>::PolynomialNode;
+
+    struct Instruction {
+        const Node* node;
+        int first;
+        int second;
+    };
+
+    static constexpr size_t blockSize = 256;
+
+    std::vector<NodePtr> roots;
+    std::vector<Instruction> instructions;
+    std::vector<int> functionOperands;
+    std::vector<int> outputs;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int> variableIndices;
+    std::unordered_map<const Node*, int> visited;
+    std::unordered_map<std::string, int> unique;
+
+    size_t maxArity = 0;
+
+    int compile(const NodePtr& node);
+    uint32_t run(const T* const* columns, size_t count, T* const* results, T* buffer, const T** arguments, T* point) const;
+};
+
+// Разреженный якобиан системы уравнений в формате CSR. Каждая переменная дифференцируется
+// по всем ссылающимся на неё уравнениям за один проход, а все ненулевые элементы
+// вычисляются одним ExpressionSet с общими подвыражениями.
+template<typename T>
+class Jacobian {
+public:
+    Jacobian(const std::vector<Expression<T>>& equations, const std::vector<std::string>& variables);
+
+    size_t rows() const { return rowStart.size() - 1; }
+    size_t columns() const { return variables.size(); }
+    size_t nonZeros() const { return entries.size(); }
+
+    const std::vector<size_t>& rowOffsets() const { return rowStart; }
+    const std::vector<size_t>& columnIndices() const { return entryColumns; }
+    const Expression<T>& entry(size_t index) const { return entries[index]; }
+
+    std::optional<std::vector<T>> evaluate(const std::map<std::string, T>& values) const;
+    std::optional<std::vector<std::vector<T>>> evaluateBatch(const std::map<std::string, std::vector<T>>& values) const;
+    std::optional<std::vector<std::vector<T>>> evaluateDense(const std::map<std::string, T>& values) const;
+
+private:
+    std::vector<std::string> variables;
+    std::vector<size_t> rowStart;
+    std::vector<size_t> entryColumns;
+    std::vector<Expression<T>> entries;
+    ExpressionSet<T> compiled;
 };
 
-template<>
-std::string Expression<std::complex<double>>::ConstantNode::toString() const;
+// Каталог именованных формул в стиле RCU: читатели берут снимок без блокировок,
+// писатели копируют карту, изменяют копию и атомарно публикуют её.
+template<typename T>
+class ExpressionCatalog {
+public:
+    using Formulas = std::map<std::string, Expression<T>>;
+    using Snapshot = std::shared_ptr<const Formulas>;
+
+    ExpressionCatalog();
+
+    Snapshot snapshot() const;
+    std::optional<Expression<T>> find(const std::string& name) const;
+    size_t size() const;
+
+    void publish(const std::string& name, const Expression<T>& expr);
+    bool remove(const std::string& name);
+    void replaceAll(Formulas formulas);
 
+private:
+    void store(Snapshot next);
+
+    // Только через atomic_load/atomic_store, чтобы раскладка не зависела от стандарта сборки.
+    Snapshot current;
+    std::mutex writerMutex;
+};
+
+// Файловый кэш разобранных формул и их производных для быстрого старта. Ключ — хеш текста
+// формулы (с проверкой самого текста). Файл состоит из заголовка с версией, типом чисел и
+// контрольной суммой и плоских таблиц записей фиксированного размера, выровненных на 16 байт,
+// поэтому его можно отобразить в память. Узлы записаны по порядку (дети раньше родителей) и
+// восстанавливаются лениво при первом обращении к формуле, общие поддеревья остаются общими.
+// Файл с другой версией, другим типом или неверной суммой игнорируется. Кэш заполняется
+// при старте из одного потока; полученные выражения затем можно использовать где угодно.
 template<typename T>
-std::string Expression<T>::ConstantNode::toString() const {
-    return std::to_string(value);
-}
+class FormulaCache {
+public:
+    explicit FormulaCache(std::string path);
+
+    bool loaded() const { return fromFile; }
+    size_t size() const;
+    size_t hits() const { return hitCount; }
+    size_t misses() const { return missCount; }
+
+    // Выражение из кэша или fromString; производные из файла сразу попадают в кэш выражения,
+    // так что differentiate по сохранённым переменным не пересчитывает их.
+    Expression<T> parse(const std::string& formula);
+
+    // Сохраняет все формулы вместе с уже вычисленными производными.
+    void save();
+
+    static constexpr uint32_t formatVersion = 1;
+
+private:
+    using Node = typename Expression<T>::Node;
+    using NodePtr = typename Expression<T>::NodePtr;
+    using Kind = typename Expression<T>::Kind;
+    using Function = typename Expression<T>::Function;
+    using ConstantNode = typename Expression<T>::ConstantNode;
+    using VariableNode = typename Expression<T>::VariableNode;
+    using BinaryOperationNode = typename Expression<T>::BinaryOperationNode;
+    using UnaryOperationNode = typename Expression<T>::UnaryOperationNode;
+    using FunctionNode = typename Expression<T>::FunctionNode;
+    using PolynomialNode = typename Expression<T>::PolynomialNode;
+
+    struct Section {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t valueSize;
+        uint32_t complex;
+        uint32_t reserved;
+        uint64_t checksum;
+        Section sections[7];
+    };
+
+    struct EntryRecord {
+        uint64_t hash;
+        uint32_t text;
+        uint32_t root;
+        uint32_t derivatives;
+        uint32_t derivativeCount;
+    };
+
+    struct DerivativeRecord {
+        uint32_t variable;
+        uint32_t node;
+    };
+
+    // Constant: a — индекс константы; Variable: a — строка; BinaryOperation: op, a, b — операнды;
+    // UnaryOperation: op — функция, a — операнд; FunctionCall: a — имя, b — смещение аргументов
+    // в indices, c — арность; Polynomial: a — основание, b — смещение пар (степень, константа), c — число слагаемых.
+    struct NodeRecord {
+        uint8_t kind;
+        uint8_t op;
+        uint16_t reserved;
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+    };
+
+    struct StringRecord {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    struct Tables {
+        std::vector<EntryRecord> entries;
+        std::vector<DerivativeRecord> derivatives;
+        std::vector<NodeRecord> nodes;
+        std::vector<uint32_t> indices;
+        std::vector<T> constants;
+        std::vector<StringRecord> strings;
+        std::string characters;
+    };
+
+    struct Writer;
+
+    struct Formula {
+        std::string text;
+        std::optional<Expression<T>> expression;
+        int entry = -1;
+    };
+
+    std::string path;
+    bool fromFile = false;
+    Tables tables;
+    std::vector<NodePtr> nodes;
+    std::vector<Formula> formulas;
+    std::unordered_map<uint64_t, std::vector<size_t>> byHash;
+    size_t hitCount = 0;
+    size_t missCount = 0;
+
+    static uint64_t hash(const char* data, size_t size, uint64_t seed = 14695981039346656037ull);
+    static uint64_t checksum(const std::string& payload);
+    bool load();
+    std::string text(uint32_t id) const;
+    NodePtr materialize(uint32_t index);
+    Expression<T> prepare(const Formula& formula);
+};
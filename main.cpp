@@ -4,15 +4,44 @@
 #include <string>
 #include <type_traits>
 #include <algorithm>
+#include <vector>
+#include <cctype>
 
 template<typename T>
-void evaluateAndPrint(const std::string& exprStr, const std::map<std::string, T>& variables) {
+void printStatistics(const std::string& title, const Expression<T>& expr) {
+    auto stats = expr.statistics();
+    std::cerr << title << ": узлов " << stats.nodes()
+              << " (константы " << stats.constants
+              << ", переменные " << stats.variables
+              << ", бинарные " << stats.binaryOperations
+              << ", унарные " << stats.unaryOperations
+              << ", функции " << stats.functionCalls
+              << ", многочлены " << stats.polynomials
+              << "), глубина " << stats.depth << std::endl;
+}
+
+template<typename T>
+void printProfile() {
+    if (!Expression<T>::profilingEnabled()) {
+        std::cerr << "Профилирование: отключено (сборка с -DEXPRESSION_PROFILING)" << std::endl;
+        return;
+    }
+    auto profile = Expression<T>::profile();
+    std::cerr << "Выделено узлов: " << profile.allocations << std::endl;
+    std::cerr << "Время разбора: " << profile.parseSeconds << " с" << std::endl;
+    std::cerr << "Время упрощения: " << profile.simplifySeconds << " с" << std::endl;
+    std::cerr << "Время дифференцирования: " << profile.differentiateSeconds << " с" << std::endl;
+    std::cerr << "Время вычисления: " << profile.evaluateSeconds << " с" << std::endl;
+}
+
+template<typename T>
+void evaluateAndPrint(const std::string& exprStr, const std::map<std::string, T>& variables, bool stats) {
     try {
         auto expr = Expression<T>::fromString(exprStr);
         auto result = expr.evaluate(variables);
 
         if (result) {
-            if constexpr (std::is_same_v<T, std::complex<double>>) {
+            if constexpr (IsComplex<T>::value) {
                 if (result->imag() == 0) {
                     std::cout << "Вычисление: " << result->real() << std::endl;
                 } else {
@@ -24,22 +53,89 @@ void evaluateAndPrint(const std::string& exprStr, const std::map<std::string, T>
         } else {
             std::cerr << "Ошибка" << std::endl;
         }
+        if (stats) {
+            printStatistics("Выражение", expr);
+            printProfile<T>();
+        }
     } catch (const std::exception& e) {
         std::cerr << "Ошибка: " << e.what() << std::endl;
     }
 }
 
 template<typename T>
-void differentiateAndPrint(const std::string& exprStr, const std::string& variable) {
+void differentiateAndPrint(const std::string& exprStr, const std::string& variable, bool stats) {
     try {
         auto expr = Expression<T>::fromString(exprStr);
         auto derivative = expr.differentiate(variable);
         std::cout << derivative.toString() << std::endl;
+        if (stats) {
+            printStatistics("Выражение", expr);
+            printStatistics("Производная", derivative);
+            printProfile<T>();
+        }
     } catch (const std::exception& e) {
         std::cerr << "Ошибка: " << e.what() << std::endl;
     }
 }
 
+size_t complexSeparator(const std::string& valueStr) {
+    for (size_t pos = 1; pos < valueStr.size(); ++pos) {
+        char prev = valueStr[pos - 1];
+        if ((valueStr[pos] == '+' || valueStr[pos] == '-') && prev != 'e' && prev != 'E') {
+            return pos;
+        }
+    }
+    return std::string::npos;
+}
+
+// Комплексным считается только значение с мнимой единицей в конце или с разделителем
+// действительной и мнимой частей, поэтому inf и nan остаются действительными.
+bool isComplexValue(const std::string& valueStr) {
+    return (!valueStr.empty() && valueStr.back() == 'i') || complexSeparator(valueStr) != std::string::npos;
+}
+
+std::complex<double> parseComplex(std::string valueStr) {
+    bool imaginary = !valueStr.empty() && valueStr.back() == 'i';
+    if (imaginary) {
+        valueStr.pop_back();
+    }
+    size_t separator = complexSeparator(valueStr);
+    if (separator != std::string::npos) {
+        return std::complex<double>(std::stod(valueStr.substr(0, separator)), std::stod(valueStr.substr(separator)));
+    }
+    if (imaginary) {
+        return std::complex<double>(0, valueStr.empty() || valueStr == "+" ? 1.0 : valueStr == "-" ? -1.0 : std::stod(valueStr));
+    }
+    return std::complex<double>(std::stod(valueStr), 0);
+}
+
+bool usesImaginaryUnit(const std::string& exprStr) {
+    size_t pos = 0;
+    while (pos < exprStr.size()) {
+        if (!std::isalpha(static_cast<unsigned char>(exprStr[pos]))) {
+            pos++;
+            continue;
+        }
+        size_t start = pos;
+        while (pos < exprStr.size() && (std::isalnum(static_cast<unsigned char>(exprStr[pos])) || exprStr[pos] == '_')) {
+            pos++;
+        }
+        if (exprStr.compare(start, pos - start, "i") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool takeFlag(std::vector<char*>& args, const std::string& flag) {
+    auto it = std::find_if(args.begin(), args.end(), [&](const char* arg) { return flag == arg; });
+    if (it == args.end()) {
+        return false;
+    }
+    args.erase(it);
+    return true;
+}
+
 template<typename T>
 std::map<std::string, T> parseVariables(int argc, char* argv[], int startIndex) {
     std::map<std::string, T> variables;
@@ -50,17 +146,10 @@ std::map<std::string, T> parseVariables(int argc, char* argv[], int startIndex)
             std::string name = arg.substr(0, equalsPos);
             std::string valueStr = arg.substr(equalsPos + 1);
             T value;
-            if constexpr (std::is_same_v<T, std::complex<double>>) {
-                size_t plusPos = valueStr.find('+');
-                if (plusPos != std::string::npos) {
-                    double real = std::stod(valueStr.substr(0, plusPos));
-                    double imag = std::stod(valueStr.substr(plusPos + 1));
-                    value = std::complex<double>(real, imag);
-                } else {
-                    value = std::complex<double>(std::stod(valueStr), 0);
-                }
+            if constexpr (IsComplex<T>::value) {
+                value = T(parseComplex(valueStr));
             } else {
-                value = std::stod(valueStr);
+                value = static_cast<T>(std::stod(valueStr));
             }
             variables[name] = value;
         }
@@ -69,23 +158,40 @@ std::map<std::string, T> parseVariables(int argc, char* argv[], int startIndex)
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " --eval <expression> [variables...]" << std::endl;
-        std::cerr << "       " << argv[0] << " --diff <expression> --by <variable>" << std::endl;
+    std::vector<char*> args(argv, argv + argc);
+    bool stats = takeFlag(args, "--stats");
+    bool forceReal = takeFlag(args, "--real");
+    bool forceComplex = takeFlag(args, "--complex");
+    argc = static_cast<int>(args.size());
+    argv = args.data();
+
+    if (argc < 3 || (forceReal && forceComplex)) {
+        std::cerr << "Usage: " << argv[0] << " --eval <expression> [variables...] [--real|--complex] [--stats]" << std::endl;
+        std::cerr << "       " << argv[0] << " --diff <expression> --by <variable> [--real|--complex] [--stats]" << std::endl;
         return 1;
     }
 
     std::string mode = argv[1];
     std::string exprStr = argv[2];
-    bool isComplex = exprStr.find('i') != std::string::npos;
+    bool isComplex = forceComplex;
+    if (!forceReal && !forceComplex) {
+        isComplex = usesImaginaryUnit(exprStr);
+        if (mode == "--eval") {
+            for (int i = 3; i < argc && !isComplex; ++i) {
+                std::string arg = argv[i];
+                size_t equalsPos = arg.find('=');
+                isComplex = equalsPos != std::string::npos && isComplexValue(arg.substr(equalsPos + 1));
+            }
+        }
+    }
 
     if (mode == "--eval") {
         if (isComplex) {
             auto variables = parseVariables<std::complex<double>>(argc, argv, 3);
-            evaluateAndPrint<std::complex<double>>(exprStr, variables);
+            evaluateAndPrint<std::complex<double>>(exprStr, variables, stats);
         } else {
             auto variables = parseVariables<double>(argc, argv, 3);
-            evaluateAndPrint<double>(exprStr, variables);
+            evaluateAndPrint<double>(exprStr, variables, stats);
         }
     } else if (mode == "--diff") {
         if (argc < 5 || std::string(argv[3]) != "--by") {
@@ -94,9 +200,9 @@ int main(int argc, char* argv[]) {
         }
         std::string variable = argv[4];
         if (isComplex) {
-            differentiateAndPrint<std::complex<double>>(exprStr, variable);
+            differentiateAndPrint<std::complex<double>>(exprStr, variable, stats);
         } else {
-            differentiateAndPrint<double>(exprStr, variable);
+            differentiateAndPrint<double>(exprStr, variable, stats);
         }
     } else {
         std::cerr << "Неизвестно: " << mode << std::endl;
@@ -1,5 +1,9 @@
 #include "expression.hpp"
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 
 void tests() {
 
@@ -209,6 +213,450 @@ void tests() {
     Expression<double> diffExpr2 = expr4.differentiate("x").simplify();
     std::cout << "Производная:" << std::endl;
     std::cout << diffExpr2.toString() << std::endl;
+
+    auto stats1 = Expression<double>::fromString("sin(x) * x + 2").statistics();
+    Expression<double> doubled1("x");
+    for (int k = 0; k < 40; ++k) {
+        doubled1 = doubled1 + doubled1;
+    }
+    auto stats_doubled1 = doubled1.statistics();
+    if (stats1.constants == 1 && stats1.variables == 2 && stats1.binaryOperations == 2 && stats1.unaryOperations == 1 && stats1.depth == 4 &&
+        stats_doubled1.variables == (size_t(1) << 40) && stats_doubled1.nodes() == (size_t(1) << 41) - 1 && stats_doubled1.depth == 41) {
+        std::cout << "Test 14: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 14: FAIL" << std::endl;
+    }
+
+    auto quotient = Expression<double>::fromString("x / (x + 1)").differentiate("x");
+    auto result_quotient = quotient.evaluate({{"x", 1.0}});
+    if (result_quotient && std::fabs(*result_quotient - 0.25) < 1e-12) {
+        std::cout << "Test 15: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 15: FAIL" << std::endl;
+    }
+
+    auto power = Expression<double>::fromString("-(x ^ x) + sin(x) ^ 2").differentiate("x").simplify();
+    auto result_power = power.evaluate({{"x", 2.0}});
+    double check_power = -4.0 * (std::log(2.0) + 1.0) + 2.0 * std::sin(2.0) * std::cos(2.0);
+    if (result_power && std::fabs(*result_power - check_power) < 1e-12) {
+        std::cout << "Test 16: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 16: FAIL" << std::endl;
+    }
+
+    auto functions1 = Expression<double>::fromString("atan2(y, x) + min(x, y) * sqrt(x) + tan(x ^ 2)");
+    auto diff_functions1 = functions1.differentiate("x");
+    auto result_functions1 = diff_functions1.evaluate({{"x", 1.0}, {"y", 2.0}});
+    double check_functions1 = -2.0 / 5.0 + 1.5 + 2.0 / (std::cos(1.0) * std::cos(1.0));
+    if (result_functions1 && std::fabs(*result_functions1 - check_functions1) < 1e-12) {
+        std::cout << "Test 17: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 17: FAIL" << std::endl;
+    }
+
+    Expression<double>::FunctionDefinition cube;
+    cube.name = "cube";
+    cube.evaluate = [](const double* a) { return a[0] * a[0] * a[0]; };
+    cube.partialDerivative = [](const std::vector<Expression<double>>& a, size_t) {
+        return Expression<double>(3.0) * (a[0] ^ Expression<double>(2.0));
+    };
+    Expression<double>::registerFunction(cube);
+    auto functions2 = Expression<double>::fromString("cube(2x) + sqrt(x)");
+    auto result_functions2 = functions2.evaluateBatch({{"x", {1.0, 4.0}}});
+    auto result_diff_functions2 = functions2.differentiate("x").evaluate({{"x", 4.0}});
+    if (result_functions2 && (*result_functions2)[0] == 9.0 && (*result_functions2)[1] == 514.0 &&
+        result_diff_functions2 && std::fabs(*result_diff_functions2 - 384.25) < 1e-12) {
+        std::cout << "Test 18: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 18: FAIL" << std::endl;
+    }
+
+    const auto shared1 = Expression<double>::fromString("sin(x) * exp(y) / (x ^ 2 + y)");
+    const auto check_shared1_value = *shared1.evaluate({{"x", 0.5}, {"y", 1.5}});
+    const auto check_shared1_diff = shared1.differentiate("x").toString();
+    std::atomic<bool> shared1_ok{true};
+    std::vector<std::thread> shared1_threads;
+    for (int t = 0; t < 4; ++t) {
+        shared1_threads.emplace_back([&, copy = shared1] {
+            for (int i = 0; i < 200; ++i) {
+                Expression<double> local = copy;
+                if (*local.evaluate({{"x", 0.5}, {"y", 1.5}}) != check_shared1_value ||
+                    local.differentiate("x").toString() != check_shared1_diff) {
+                    shared1_ok = false;
+                }
+            }
+        });
+    }
+    for (auto& thread : shared1_threads) {
+        thread.join();
+    }
+    if (shared1_ok) {
+        std::cout << "Test 19: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 19: FAIL" << std::endl;
+    }
+
+    ExpressionCatalog<double> catalog;
+    catalog.publish("f", Expression<double>::fromString("x + 1"));
+    std::atomic<bool> catalog_ok{true};
+    std::atomic<bool> catalog_done{false};
+    std::vector<std::thread> catalog_readers;
+    for (int t = 0; t < 3; ++t) {
+        catalog_readers.emplace_back([&] {
+            while (!catalog_done) {
+                auto formula = catalog.find("f");
+                auto value = formula ? formula->evaluate({{"x", 1.0}}) : std::nullopt;
+                if (!value || *value < 2.0 || *value > 101.0) {
+                    catalog_ok = false;
+                }
+            }
+        });
+    }
+    for (int version = 2; version <= 100; ++version) {
+        catalog.publish("f", Expression<double>::fromString("x + " + std::to_string(version)));
+    }
+    catalog_done = true;
+    for (auto& thread : catalog_readers) {
+        thread.join();
+    }
+    if (catalog_ok && catalog.size() == 1 && *catalog.find("f")->evaluate({{"x", 1.0}}) == 101.0 && catalog.remove("f") && !catalog.find("f")) {
+        std::cout << "Test 20: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 20: FAIL" << std::endl;
+    }
+
+    std::vector<Expression<double>> pricing = {
+        Expression<double>::fromString("exp(r * t) * S - K"),
+        Expression<double>::fromString("exp(r * t) * K + sqrt(S)"),
+        Expression<double>::fromString("exp(r * t) / (1 + exp(r * t))"),
+    };
+    ExpressionSet<double> pricingSet(pricing);
+    size_t pricing_nodes = 0;
+    for (const auto& formula : pricing) {
+        pricing_nodes += formula.statistics().nodes();
+    }
+    std::map<std::string, double> variables_pricing = {{"r", 0.05}, {"t", 2.0}, {"S", 100.0}, {"K", 95.0}};
+    auto result_pricing = pricingSet.evaluate(variables_pricing);
+    auto batch_pricing = pricingSet.evaluateBatch({{"r", {0.05, 0.01}}, {"t", {2.0, 1.0}}, {"S", {100.0, 50.0}}, {"K", {95.0, 40.0}}});
+    bool pricing_ok = result_pricing && batch_pricing && pricingSet.size() == 3 && pricingSet.instructionCount() < pricing_nodes - 8;
+    for (size_t k = 0; pricing_ok && k < pricing.size(); ++k) {
+        pricing_ok = (*result_pricing)[k] == *pricing[k].evaluate(variables_pricing) &&
+                     (*batch_pricing)[k][0] == (*result_pricing)[k] &&
+                     (*batch_pricing)[k][1] == *pricing[k].evaluate({{"r", 0.01}, {"t", 1.0}, {"S", 50.0}, {"K", 40.0}});
+    }
+    if (pricing_ok) {
+        std::cout << "Test 21: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 21: FAIL" << std::endl;
+    }
+
+    Jacobian<double> jacobian1({
+        Expression<double>::fromString("x * y + sin(z)"),
+        Expression<double>::fromString("x ^ 2 + y - y"),
+        Expression<double>::fromString("exp(y) * z"),
+    }, {"x", "y", "z"});
+    auto dense_jacobian1 = jacobian1.evaluateDense({{"x", 2.0}, {"y", 0.5}, {"z", 3.0}});
+    std::vector<std::vector<double>> check_jacobian1 = {
+        {0.5, 2.0, std::cos(3.0)},
+        {4.0, 0.0, 0.0},
+        {0.0, 3.0 * std::exp(0.5), std::exp(0.5)},
+    };
+    Jacobian<std::complex<double>> jacobian2({Expression<std::complex<double>>::fromString("x * y")}, {"x", "y"});
+    auto result_jacobian2 = jacobian2.evaluate({{"x", {1.0, 1.0}}, {"y", {2.0, -1.0}}});
+    if (jacobian1.nonZeros() == 6 && jacobian1.rowOffsets() == std::vector<size_t>{0, 3, 4, 6} && dense_jacobian1 &&
+        std::fabs((*dense_jacobian1)[0][2] - check_jacobian1[0][2]) < 1e-12 && (*dense_jacobian1)[1] == check_jacobian1[1] &&
+        (*dense_jacobian1)[2] == check_jacobian1[2] && (*dense_jacobian1)[0][0] == 0.5 && (*dense_jacobian1)[0][1] == 2.0 &&
+        result_jacobian2 && (*result_jacobian2)[0] == std::complex<double>(2.0, -1.0) && (*result_jacobian2)[1] == std::complex<double>(1.0, 1.0)) {
+        std::cout << "Test 22: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 22: FAIL" << std::endl;
+    }
+
+    auto float1 = Expression<float>::fromString("3.5 * x ^ 2 + sqrt(x)").differentiate("x");
+    auto result_float1 = float1.evaluate({{"x", 4.0f}});
+    auto long1 = Expression<long double>::fromString("exp(0.1) * x");
+    auto result_long1 = long1.evaluate({{"x", 1.0L}});
+    auto complex_float1 = Expression<std::complex<float>>::fromString("x * (1 + 2i)");
+    auto result_complex_float1 = complex_float1.evaluate({{"x", std::complex<float>(2.0f, 0.0f)}});
+    if (result_float1 && *result_float1 == 28.25f &&
+        result_long1 && std::fabs(*result_long1 - std::exp(0.1L)) < 1e-18L &&
+        result_complex_float1 && *result_complex_float1 == std::complex<float>(2.0f, 4.0f) &&
+        Expression<float>::fromString("0.1").toString() == "0.100000") {
+        std::cout << "Test 23: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 23: FAIL" << std::endl;
+    }
+
+    auto poly1 = Expression<double>::fromString("(x + 1) ^ 3 - 2 * x");
+    auto coefficients_poly1 = poly1.polynomialCoefficients("x");
+    auto poly2 = Expression<double>::fromString("sin((x + 1) ^ 2) + (x ^ 2 - 1) / (x ^ 10 + 2 * x) + y * 3");
+    auto canonical_poly2 = poly2.toPolynomialForm();
+    auto derivative_poly2 = canonical_poly2.differentiate("x");
+    std::map<std::string, double> variables_poly2 = {{"x", 0.7}, {"y", -1.5}};
+    ExpressionSet<double> set_poly2({canonical_poly2, derivative_poly2});
+    auto result_set_poly2 = set_poly2.evaluate(variables_poly2);
+    auto reparsed_poly2 = Expression<double>::fromString(canonical_poly2.toString());
+    if (coefficients_poly1 && *coefficients_poly1 == std::vector<double>{1.0, 1.0, 3.0, 1.0} &&
+        !Expression<double>::fromString("x * y").polynomialCoefficients("x") &&
+        canonical_poly2.statistics().polynomials == 5 &&
+        std::fabs(*canonical_poly2.evaluate(variables_poly2) - *poly2.evaluate(variables_poly2)) < 1e-12 &&
+        std::fabs(*derivative_poly2.evaluate(variables_poly2) - *poly2.differentiate("x").evaluate(variables_poly2)) < 1e-12 &&
+        std::fabs(*reparsed_poly2.evaluate(variables_poly2) - *poly2.evaluate(variables_poly2)) < 1e-12 &&
+        result_set_poly2 && (*result_set_poly2)[1] == *derivative_poly2.evaluate(variables_poly2) &&
+        Expression<double>::fromString("(x + 1) ^ 2").toPolynomialForm().toString() == "((x) + (1.000000)) ^ (2.000000)") {
+        std::cout << "Test 24: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 24: FAIL" << std::endl;
+    }
+
+    Expression<double>::resetCacheStatistics();
+    auto cache1 = Expression<double>::fromString("x * y + sin(y) * exp(y)");
+    auto derivative_cache1 = cache1.differentiate("x");
+    auto copy_cache1 = cache1;
+    auto again_cache1 = copy_cache1.differentiate("x");
+    auto second_cache1 = cache1.differentiate("y").differentiate("y");
+    auto compiled_cache1 = cache1.compiledDerivative("y");
+    auto result_cache1 = compiled_cache1->evaluate({{"x", 2.0}, {"y", 0.5}});
+    auto check_cache1 = cache1.differentiate("y").evaluate({{"x", 2.0}, {"y", 0.5}});
+    auto stats_cache1 = Expression<double>::cacheStatistics();
+    size_t zero_nodes_cache1 = 0;
+    {
+        auto fresh = Expression<double>::fromString("x + 1");
+        Expression<double>::BudgetScope scope(Expression<double>::Budget{});
+        fresh.differentiate("z");
+        fresh.differentiate("x").differentiate("z");
+        zero_nodes_cache1 = scope.nodes();
+    }
+    if (derivative_cache1.toString() == again_cache1.toString() &&
+        cache1.differentiate("z").toString() == "0.000000" && cache1.simplifiedDerivative("x").toString() == "y" &&
+        compiled_cache1 == cache1.compiledDerivative("y") && result_cache1 && std::fabs((*result_cache1)[0] - *check_cache1) < 1e-12 &&
+        second_cache1.toString() == cache1.differentiate("y").differentiate("y").toString() &&
+        stats_cache1.hits == 2 && stats_cache1.misses == 4 && zero_nodes_cache1 == 4) {
+        std::cout << "Test 25: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 25: FAIL" << std::endl;
+    }
+
+    const std::string path_disk1 = "formula_cache_test.bin";
+    std::remove(path_disk1.c_str());
+    const std::string formula_disk1 = "x ^ 3 * sin(y) + atan2(x, y)";
+    const std::string formula_disk2 = "exp(x * y) / (1 + x)";
+    bool cold_disk1;
+    std::string derivative_disk1;
+    {
+        FormulaCache<double> cold(path_disk1);
+        cold_disk1 = !cold.loaded() && cold.size() == 0;
+        derivative_disk1 = cold.parse(formula_disk1).differentiate("x").toString();
+        cold.parse(formula_disk2);
+        cold_disk1 = cold_disk1 && cold.misses() == 2 && cold.size() == 2;
+        cold.save();
+    }
+    FormulaCache<double> warm_disk1(path_disk1);
+    Expression<double>::resetCacheStatistics();
+    auto expr_disk1 = warm_disk1.parse(formula_disk1);
+    auto warm_derivative_disk1 = expr_disk1.differentiate("x");
+    auto stats_disk1 = Expression<double>::cacheStatistics();
+    std::map<std::string, double> variables_disk1 = {{"x", 1.5}, {"y", 0.5}};
+    bool warm_disk1_ok = warm_disk1.loaded() && warm_disk1.size() == 2 && warm_disk1.hits() == 1 && warm_disk1.misses() == 0 &&
+                         stats_disk1.hits == 1 && stats_disk1.misses == 0 && warm_derivative_disk1.toString() == derivative_disk1 &&
+                         *expr_disk1.evaluate(variables_disk1) == *Expression<double>::fromString(formula_disk1).evaluate(variables_disk1) &&
+                         warm_disk1.parse(formula_disk2).toString() == Expression<double>::fromString(formula_disk2).toString();
+    {
+        std::fstream file(path_disk1, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(-1, std::ios::end);
+        file.put('#');
+    }
+    bool corrupt_disk1 = !FormulaCache<double>(path_disk1).loaded() && !FormulaCache<float>(path_disk1).loaded();
+    std::remove(path_disk1.c_str());
+    if (cold_disk1 && warm_disk1_ok && corrupt_disk1) {
+        std::cout << "Test 26: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 26: FAIL" << std::endl;
+    }
+
+    ExpressionSet<double> hot1({Expression<double>::fromString("ln(x) + 1 / y"), Expression<double>::fromString("x * y")});
+    auto binding_hot1 = hot1.bind({"y", "x", "unused"});
+    std::vector<double> x_hot1 = {1.0, -1.0, 2.0}, y_hot1 = {1.0, 2.0, 0.0};
+    std::vector<double> first_hot1(3), second_hot1(3);
+    const double* columns_hot1[] = {y_hot1.data(), x_hot1.data(), nullptr};
+    double* outputs_hot1[] = {first_hot1.data(), second_hot1.data()};
+    uint32_t errors_hot1 = hot1.evaluateBound(binding_hot1, columns_hot1, 3, outputs_hot1);
+    uint32_t clean_hot1 = hot1.evaluateBound(binding_hot1, columns_hot1, 1, outputs_hot1);
+    bool missing_hot1 = false;
+    try {
+        hot1.bind({"x"});
+    } catch (const std::invalid_argument&) {
+        missing_hot1 = true;
+    }
+    ExpressionSet<double> masked_hot1({Expression<double>::fromString("min(0, sqrt(x))"), Expression<double>::fromString("sqrt(x) ^ 0")});
+    auto masked_binding_hot1 = masked_hot1.bind({"x"});
+    std::vector<double> masked_x_hot1 = {-1.0}, masked_first_hot1(1), masked_second_hot1(1);
+    const double* masked_columns_hot1[] = {masked_x_hot1.data()};
+    double* masked_outputs_hot1[] = {masked_first_hot1.data(), masked_second_hot1.data()};
+    uint32_t masked_errors_hot1 = masked_hot1.evaluateBound(masked_binding_hot1, masked_columns_hot1, 1, masked_outputs_hot1);
+    ExpressionSet<double> pointwise_hot1({Expression<double>::fromString("cube(x) + 1")});
+    auto pointwise_binding_hot1 = pointwise_hot1.bind({"x"});
+    std::vector<double> pointwise_result_hot1(1);
+    double* pointwise_outputs_hot1[] = {pointwise_result_hot1.data()};
+    uint32_t pointwise_errors_hot1 = pointwise_hot1.evaluateBound(pointwise_binding_hot1, masked_columns_hot1, 1, pointwise_outputs_hot1);
+    bool pointwise_hot1_ok = pointwise_errors_hot1 == 0 && pointwise_result_hot1[0] == 0.0;
+    bool columns_hot1_ok = pointwise_hot1_ok && binding_hot1.columns() == std::vector<size_t>({1, 0}) &&
+                           masked_errors_hot1 == ExpressionSet<double>::NotANumber && masked_first_hot1[0] == 0.0 && masked_second_hot1[0] == 1.0;
+    hot1.add(Expression<double>::fromString("sqrt(x) * y"));
+    uint32_t stale_hot1 = hot1.evaluateBound(binding_hot1, columns_hot1, 3, outputs_hot1);
+    if (errors_hot1 == (ExpressionSet<double>::DivisionByZero | ExpressionSet<double>::LogarithmDomain | ExpressionSet<double>::NotANumber) &&
+        clean_hot1 == 0 && first_hot1[0] == 1.0 && second_hot1[0] == 1.0 && std::isnan(first_hot1[1]) && std::isinf(first_hot1[2]) &&
+        second_hot1[1] == -2.0 && second_hot1[2] == 0.0 && missing_hot1 && columns_hot1_ok &&
+        stale_hot1 == ExpressionSet<double>::StaleBinding) {
+        std::cout << "Test 27: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 27: FAIL" << std::endl;
+    }
+
+    auto budget1 = Expression<double>::fromString("x * x + sin(x * x)");
+    auto footprint_budget1 = budget1.footprint();
+    auto nested_budget1 = Expression<double>::fromString("sin(x) / (1 + x * exp(x) / (2 + cos(x) * x))");
+    auto derivative_budget1 = nested_budget1;
+    for (int k = 0; k < 4; ++k) {
+        derivative_budget1 = derivative_budget1.differentiate("x");
+    }
+    auto footprint_derivative_budget1 = derivative_budget1.footprint();
+    auto substituted_budget1 = derivative_budget1.substitute("y", 1.0);
+    bool abort_budget1 = false;
+    try {
+        Expression<double>::BudgetScope scope({50, SIZE_MAX, SIZE_MAX, false});
+        auto derivative = Expression<double>::fromString(nested_budget1.toString()).differentiate("x").differentiate("x").differentiate("x");
+    } catch (const std::length_error&) {
+        abort_budget1 = true;
+    }
+    bool parse_budget1 = false;
+    try {
+        Expression<double>::BudgetScope scope({SIZE_MAX, 256, SIZE_MAX, false});
+        Expression<double>::fromString("x + x + x + x + x + x + x + x + x + x");
+    } catch (const std::length_error&) {
+        parse_budget1 = true;
+    }
+    bool shared_budget1 = false;
+    {
+        Expression<double>::BudgetScope scope({SIZE_MAX, SIZE_MAX, 200, true});
+        auto derivative = Expression<double>::fromString(nested_budget1.toString()).differentiate("x").differentiate("x").differentiate("x");
+        bool printed = true;
+        try {
+            derivative.toString();
+        } catch (const std::length_error&) {
+            printed = false;
+        }
+        ExpressionSet<double> compiled({derivative});
+        auto value = compiled.evaluate({{"x", 0.3}});
+        shared_budget1 = scope.degraded() && !printed && scope.nodes() > 0 && value &&
+                         std::fabs((*value)[0] - *nested_budget1.differentiate("x").differentiate("x").differentiate("x").evaluate({{"x", 0.3}})) < 1e-9;
+    }
+    bool nested_budget1_ok = false;
+    {
+        Expression<double>::BudgetScope outer({5, SIZE_MAX, SIZE_MAX, false});
+        try {
+            Expression<double>::BudgetScope inner({1000, SIZE_MAX, SIZE_MAX, false});
+            Expression<double>::fromString("x * x + sin(x * x) + y * y + cos(y) * x + x * y");
+        } catch (const std::length_error&) {
+            nested_budget1_ok = outer.nodes() == 6;
+        }
+    }
+    if (footprint_budget1.nodes == 8 && nested_budget1_ok && footprint_budget1.treeNodes == 8 && footprint_budget1.bytes > 0 &&
+        footprint_derivative_budget1.treeNodes > 4 * footprint_derivative_budget1.nodes &&
+        substituted_budget1.footprint().nodes == footprint_derivative_budget1.nodes &&
+        abort_budget1 && parse_budget1 && shared_budget1) {
+        std::cout << "Test 28: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 28: FAIL" << std::endl;
+    }
+
+    auto exp_taylor1 = Expression<double>::fromString("exp(x)").taylorCoefficients("x", 0.0, 10);
+    bool exp_ok_taylor1 = exp_taylor1 && exp_taylor1->size() == 11;
+    double factorial_taylor1 = 1.0;
+    for (size_t k = 0; exp_ok_taylor1 && k < exp_taylor1->size(); ++k) {
+        factorial_taylor1 *= k > 0 ? static_cast<double>(k) : 1.0;
+        exp_ok_taylor1 = std::fabs((*exp_taylor1)[k] - 1.0 / factorial_taylor1) < 1e-15;
+    }
+    auto cube_taylor1 = Expression<double>::fromString("x ^ 3 - 2 * x").taylorCoefficients("x", 0.0, 4);
+    bool cube_ok_taylor1 = cube_taylor1 && *cube_taylor1 == std::vector<double>({0.0, -2.0, 0.0, 1.0, 0.0});
+    auto mixed_taylor1 = Expression<double>::fromString("sin(x) * cos(y * x) / (1 + x ^ 2) + ln(2 + x) ^ 1.5 + x ^ x + tan(x / 2) + sqrt(1 + x * y)");
+    auto series_taylor1 = mixed_taylor1.taylorCoefficients("x", 0.7, 5, {{"y", 0.4}});
+    bool mixed_ok_taylor1 = series_taylor1.has_value();
+    auto derivative_taylor1 = mixed_taylor1;
+    factorial_taylor1 = 1.0;
+    for (size_t k = 0; mixed_ok_taylor1 && k <= 5; ++k) {
+        factorial_taylor1 *= k > 0 ? static_cast<double>(k) : 1.0;
+        auto value = derivative_taylor1.evaluate({{"x", 0.7}, {"y", 0.4}});
+        mixed_ok_taylor1 = value && std::fabs((*series_taylor1)[k] - *value / factorial_taylor1) < 1e-9 * (1 + std::fabs(*value));
+        derivative_taylor1 = derivative_taylor1.differentiate("x");
+    }
+    auto polynomial_taylor1 = Expression<double>::fromString("(x + 1) ^ 3").toPolynomialForm().taylorCoefficients("x", 2.0, 4);
+    bool polynomial_ok_taylor1 = polynomial_taylor1 && *polynomial_taylor1 == std::vector<double>({27.0, 27.0, 9.0, 1.0, 0.0});
+    auto surrogate_taylor1 = Expression<double>::fromString("exp(sin(x))").taylorPolynomial("x", 0.5, 12);
+    auto approximate_taylor1 = surrogate_taylor1 ? surrogate_taylor1->evaluate({{"x", 0.6}}) : std::nullopt;
+    bool surrogate_ok_taylor1 = approximate_taylor1 && surrogate_taylor1->statistics().polynomials == 1 &&
+                                std::fabs(*approximate_taylor1 - std::exp(std::sin(0.6))) < 1e-12;
+    auto complex_taylor1 = Expression<std::complex<double>>::fromString("exp(x)").taylorCoefficients("x", std::complex<double>(0, 1), 3);
+    bool complex_ok_taylor1 = complex_taylor1 && std::abs((*complex_taylor1)[3] - std::exp(std::complex<double>(0, 1)) / 6.0) < 1e-15;
+    bool missing_taylor1 = !Expression<double>::fromString("x * y").taylorCoefficients("x", 0.0, 3).has_value();
+    auto builtin_taylor1 = Expression<double>::fromString("tan(x) + sqrt(1 + x) + cube(x)");
+    size_t builtin_nodes_taylor1 = 0;
+    std::optional<std::vector<double>> builtin_series_taylor1;
+    {
+        Expression<double>::BudgetScope scope(Expression<double>::Budget{});
+        builtin_series_taylor1 = builtin_taylor1.taylorCoefficients("x", 0.0, 20);
+        builtin_nodes_taylor1 = scope.nodes();
+    }
+    bool builtin_ok_taylor1 = builtin_series_taylor1 && std::fabs((*builtin_series_taylor1)[3] - (1.0 / 3 + 1.0 / 16 + 1.0)) < 1e-14 &&
+                              builtin_nodes_taylor1 < 50;
+    if (exp_ok_taylor1 && cube_ok_taylor1 && mixed_ok_taylor1 && polynomial_ok_taylor1 && surrogate_ok_taylor1 &&
+        complex_ok_taylor1 && missing_taylor1 && builtin_ok_taylor1) {
+        std::cout << "Test 29: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 29: FAIL" << std::endl;
+    }
+
+    auto kink1 = Expression<double>::fromString("min(x, 0) + max(x, y) + abs(x)");
+    auto gradient_kink1 = kink1.differentiate("x").evaluate({{"x", 0.0}, {"y", 0.0}});
+    auto right_kink1 = kink1.differentiate("x").evaluate({{"x", 0.5}, {"y", 0.0}});
+    auto sign_kink1 = Expression<double>::fromString("sign(x)").evaluate({{"x", -3.0}});
+    if (gradient_kink1 && *gradient_kink1 == 1.0 && right_kink1 && *right_kink1 == 2.0 && sign_kink1 && *sign_kink1 == -1.0) {
+        std::cout << "Test 30: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 30: FAIL" << std::endl;
+    }
+
+    auto root_poly3 = Expression<double>::fromString("(x - 1) ^ 20 + 3 * x");
+    auto canonical_poly3 = root_poly3.toPolynomialForm();
+    auto value_poly3 = canonical_poly3.evaluate({{"x", 1.001}});
+    auto derivative_poly3 = canonical_poly3.differentiate("x").evaluate({{"x", 1.001}});
+    auto coefficients_poly3 = Expression<double>::fromString("(x - 1) ^ 2").polynomialCoefficients("x");
+    if (value_poly3 && std::fabs(*value_poly3 - (1e-60 + 3.003)) < 1e-12 &&
+        std::fabs(*Expression<double>::fromString("(x - 1) ^ 20").toPolynomialForm().evaluate({{"x", 1.001}}) - 1e-60) < 1e-70 &&
+        derivative_poly3 && std::fabs(*derivative_poly3 - (20e-57 + 3.0)) < 1e-12 &&
+        coefficients_poly3 && *coefficients_poly3 == std::vector<double>({1.0, -2.0, 1.0})) {
+        std::cout << "Test 31: OK" << std::endl;
+    }
+    else {
+        std::cout << "Test 31: FAIL" << std::endl;
+    }
 }
 
 int main() {